@@ -0,0 +1,271 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  clock.c
+
+  The real and virtual clocks -- see clock.h.
+
+  The real clock is the monotonic clock, less an offset, which is
+    normally zero, but which lets a real-time replay run on the
+    recording's own times. Deadlines are waited for with a timerfd
+    armed at an absolute time, one for each thread that waits, so
+    that time spent getting ready to wait doesn't delay anything.
+
+  The virtual clock's time is only ever changed by the driver. Each
+    follower has an eventfd, which the driver writes to when the
+    follower's deadline comes. A follower is 'parked' while it is
+    waiting; once every follower is parked, and the program says that
+    nothing it has passed them is still being worked on, the driver
+    knows that nothing else can happen before the earliest deadline,
+    and can move the clock straight there.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "clock.h"
+
+// CLOCK_MAX_FOLLOWERS is the most threads that can wait on the virtual
+//   clock, other than the one that drives it
+#define CLOCK_MAX_FOLLOWERS 4
+
+static uint64_t real_offset = 0;
+static __thread int real_timer_fd = -1;
+
+typedef struct _Follower
+  {
+  _Atomic uint64_t deadline;
+  atomic_int parked;
+  int wake_fd;
+  } Follower;
+
+static _Atomic uint64_t virtual_time = 0;
+static Follower followers[CLOCK_MAX_FOLLOWERS];
+static atomic_int nfollowers = 0;
+static __thread int follower = -1;
+static BOOL (*virtual_settled) (void) = NULL;
+
+/*======================================================================
+  real_now
+======================================================================*/
+static uint64_t real_now (void)
+  {
+  return mono_nsec() - real_offset;
+  }
+
+/*======================================================================
+  real_sleep_until
+  Like usleep(), this returns early if a signal is caught
+======================================================================*/
+static void real_sleep_until (uint64_t deadline)
+  {
+  uint64_t t = deadline + real_offset;
+  struct timespec ts = {t / 1000000000, t % 1000000000};
+  clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+  }
+
+/*======================================================================
+  real_poll
+======================================================================*/
+static int real_poll (struct pollfd *fds, int nfds, uint64_t deadline)
+  {
+  if (deadline == CLOCK_NEVER) return poll (fds, nfds, -1);
+  if (real_timer_fd < 0)
+    {
+    real_timer_fd = timerfd_create (CLOCK_MONOTONIC,
+      TFD_NONBLOCK | TFD_CLOEXEC);
+    if (real_timer_fd < 0)
+      {
+      fprintf (stderr, "Can't create timer: %s\n", strerror (errno));
+      exit (-1);
+      }
+    }
+  // An expiry time of zero would disarm the timer
+  uint64_t t = deadline + real_offset;
+  if (t == 0) t = 1;
+  struct itimerspec its;
+  memset (&its, 0, sizeof (its));
+  its.it_value.tv_sec = t / 1000000000;
+  its.it_value.tv_nsec = t % 1000000000;
+  timerfd_settime (real_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+
+  struct pollfd all[nfds + 1];
+  memcpy (all, fds, nfds * sizeof (struct pollfd));
+  all[nfds].fd = real_timer_fd;
+  all[nfds].events = POLLIN;
+  int n = poll (all, nfds + 1, -1);
+  for (int i = 0; i < nfds; i++) fds[i].revents = all[i].revents;
+  if (n > 0 && (all[nfds].revents & POLLIN))
+    {
+    uint64_t count;
+    read (real_timer_fd, &count, sizeof (count));
+    n--;
+    }
+  return n;
+  }
+
+static const Clock real_clock = {"real", real_now, real_sleep_until,
+  real_poll};
+
+const Clock *clock_source = &real_clock;
+
+/*======================================================================
+  virtual_now
+======================================================================*/
+static uint64_t virtual_now (void)
+  {
+  return atomic_load (&virtual_time);
+  }
+
+/*======================================================================
+  virtual_advance
+  Move the virtual clock forward to 'to', stopping at each follower's
+    deadline on the way, and waiting for the follower to deal with it.
+    Only called by the driver.
+======================================================================*/
+static void virtual_advance (uint64_t to)
+  {
+  int n = atomic_load (&nfollowers);
+  for (;;)
+    {
+    // The program's check must come first: a follower that has taken
+    //   everything it was given can only be parked after doing so
+    BOOL settled;
+    do
+      {
+      settled = !virtual_settled || virtual_settled();
+      for (int i = 0; i < n && settled; i++)
+        if (!atomic_load (&followers[i].parked)) settled = FALSE;
+      if (!settled) sched_yield();
+      } while (!settled);
+
+    int which = -1;
+    uint64_t next = CLOCK_NEVER;
+    for (int i = 0; i < n; i++)
+      {
+      uint64_t d = atomic_load (&followers[i].deadline);
+      if (d < next)
+        {
+        next = d;
+        which = i;
+        }
+      }
+    if (which < 0 || next > to) break;
+    if (next > atomic_load (&virtual_time))
+      atomic_store (&virtual_time, next);
+    Follower *f = &followers[which];
+    atomic_store (&f->deadline, CLOCK_NEVER);
+    atomic_store (&f->parked, 0);
+    uint64_t one = 1;
+    write (f->wake_fd, &one, sizeof (one));
+    }
+  if (to != CLOCK_NEVER && to > atomic_load (&virtual_time))
+    atomic_store (&virtual_time, to);
+  }
+
+/*======================================================================
+  virtual_poll
+  For a follower, park until one of 'fds' is ready, or the driver says
+    the deadline has come. For the driver, if none of 'fds' is ready,
+    just move the clock to the deadline.
+======================================================================*/
+static int virtual_poll (struct pollfd *fds, int nfds, uint64_t deadline)
+  {
+  int n = poll (fds, nfds, 0);
+  if (n != 0) return n;
+  if (follower < 0)
+    {
+    if (deadline == CLOCK_NEVER) return poll (fds, nfds, -1);
+    virtual_advance (deadline);
+    return 0;
+    }
+
+  Follower *f = &followers[follower];
+  struct pollfd all[nfds + 1];
+  memcpy (all, fds, nfds * sizeof (struct pollfd));
+  all[nfds].fd = f->wake_fd;
+  all[nfds].events = POLLIN;
+  atomic_store (&f->deadline, deadline);
+  atomic_store (&f->parked, 1);
+  n = poll (all, nfds + 1, -1);
+  atomic_store (&f->parked, 0);
+  for (int i = 0; i < nfds; i++) fds[i].revents = all[i].revents;
+  if (n > 0 && (all[nfds].revents & POLLIN))
+    {
+    uint64_t count;
+    read (f->wake_fd, &count, sizeof (count));
+    n--;
+    }
+  return n;
+  }
+
+/*======================================================================
+  virtual_sleep_until
+======================================================================*/
+static void virtual_sleep_until (uint64_t deadline)
+  {
+  virtual_poll (NULL, 0, deadline);
+  }
+
+static const Clock virtual_clock = {"virtual", virtual_now,
+  virtual_sleep_until, virtual_poll};
+
+/*======================================================================
+  clock_use_real
+  Use the monotonic clock, set so that it reads 'at' now
+======================================================================*/
+void clock_use_real (uint64_t at)
+  {
+  real_offset = mono_nsec() - at;
+  clock_source = &real_clock;
+  }
+
+/*======================================================================
+  clock_use_virtual
+  Use the virtual clock, starting at 'at', with the calling thread as
+    its driver. 'settled', if not NULL, says whether the followers have
+    finished with everything the driver has passed them; the clock
+    can't move on until they have. This must be called before any
+    followers are started.
+======================================================================*/
+void clock_use_virtual (uint64_t at, BOOL (*settled) (void))
+  {
+  atomic_store (&virtual_time, at);
+  virtual_settled = settled;
+  clock_source = &virtual_clock;
+  }
+
+/*======================================================================
+  clock_follow
+  Called by a thread that will wait on the clock, other than the one
+    that drives it. This does nothing on the real clock.
+======================================================================*/
+void clock_follow (void)
+  {
+  if (clock_source != &virtual_clock) return;
+  int i = atomic_fetch_add (&nfollowers, 1);
+  if (i >= CLOCK_MAX_FOLLOWERS)
+    {
+    fprintf (stderr, "Too many threads on the virtual clock\n");
+    exit (-1);
+    }
+  followers[i].wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (followers[i].wake_fd < 0)
+    {
+    fprintf (stderr, "Can't create eventfd: %s\n", strerror (errno));
+    exit (-1);
+    }
+  atomic_store (&followers[i].deadline, CLOCK_NEVER);
+  follower = i;
+  }
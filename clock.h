@@ -0,0 +1,74 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  clock.h
+
+  All reading of the time, sleeping, and waiting for deadlines goes
+    through the clock here. Normally this is the monotonic clock, but
+    a replay runs on a virtual clock, which only moves when the main
+    loop moves it, so that hours of recorded button presses can be
+    played through the program in seconds, with exactly the same
+    timing decisions as if they were played in real time.
+
+  On the virtual clock, the main loop is the 'driver': sleeping just
+    moves the clock forward. Other threads that wait for deadlines,
+    that is the output thread, are 'followers'. When the clock reaches
+    a follower's deadline, it wakes the follower, and waits for it to
+    finish what it has to do before it moves the clock on any further.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#pragma once
+
+#include <poll.h>
+#include "defs.h"
+
+// CLOCK_NEVER is a deadline that never comes
+#define CLOCK_NEVER UINT64_MAX
+
+typedef struct _Clock
+  {
+  const char *name;
+  // Get the time in nanoseconds
+  uint64_t (*now) (void);
+  // Sleep until 'deadline'
+  void (*sleep_until) (uint64_t deadline);
+  // Wait, like poll(), until one of 'fds' is ready, or until 'deadline'.
+  //   Returns the number of ready descriptors, 0 at the deadline, or -1
+  //   on error.
+  int (*poll) (struct pollfd *fds, int nfds, uint64_t deadline);
+  } Clock;
+
+extern const Clock *clock_source;
+
+void clock_use_real (uint64_t at);
+void clock_use_virtual (uint64_t at, BOOL (*settled) (void));
+void clock_follow (void);
+
+/*======================================================================
+  clock_now
+  Get the time on the clock in use
+======================================================================*/
+static inline uint64_t clock_now (void)
+  {
+  return clock_source->now();
+  }
+
+/*======================================================================
+  clock_sleep_until
+======================================================================*/
+static inline void clock_sleep_until (uint64_t deadline)
+  {
+  clock_source->sleep_until (deadline);
+  }
+
+/*======================================================================
+  clock_poll
+======================================================================*/
+static inline int clock_poll (struct pollfd *fds, int nfds,
+    uint64_t deadline)
+  {
+  return clock_source->poll (fds, nfds, deadline);
+  }
@@ -0,0 +1,81 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  defs.h
+
+  Definitions shared by all the source files
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <linux/input.h>
+
+// The usual boolean types
+#define BOOL int
+#define TRUE 1
+#define FALSE 0
+
+// MAX_PINS is the largest number of GPIO pins we will monitor. Using a fixed
+//   value makes the memory management less messy.
+#define MAX_PINS 16
+
+// A Step is one item in a mapping: a key press or release, or a pause.
+//   The event type, the code, and the value are kept in separate fields,
+//   so any code the kernel supports can be used, including those above 
+//   255, like KEY_OK and the BTN_ codes. A pause has type STEP_DELAY, 
+//   and its value is the length in milliseconds (up to a minute). A list 
+//   of steps ends with a step whose type is STEP_END.
+typedef struct _Step
+  {
+  uint16_t type;
+  uint16_t code;
+  int32_t value;
+  } Step;
+
+// STEP_END can't be confused with a real event, because SYN events
+//   are never part of a mapping -- they are added when it is compiled
+#define STEP_END 0
+#define STEP_DELAY 0xFFFF
+
+// Helpers for writing steps in the built-in mapping table
+#define PRESS(code) {EV_KEY, (code), 1}
+#define RELEASE(code) {EV_KEY, (code), 0}
+#define PAUSE(msec) {STEP_DELAY, 0, (msec)}
+#define END {STEP_END, 0, 0}
+
+// MAX_QUEUED_MACROS is the number of macros that can be waiting for
+//   their turn to be output, while an earlier macro is still running
+#define MAX_QUEUED_MACROS 32
+
+// OUTPUT_RING_SIZE is the number of button presses that can be waiting
+//   for the output thread to pick them up. It must be a power of two.
+#define OUTPUT_RING_SIZE 256
+
+// OUTPUT_BATCH_EVENTS is the largest number of events that will be
+//   written to the output device with a single system call
+#define OUTPUT_BATCH_EVENTS 1024
+
+// OUTPUT_TIMEOUT_MSEC is how long we will wait for the output device to
+//   accept events, if it is busy, before giving up
+#define OUTPUT_TIMEOUT_MSEC 100
+
+// dbglog() is defined in main.c
+void dbglog (const char *fmt,...);
+
+/*======================================================================
+  mono_nsec
+  Get the monotonic clock time in nanoseconds. All the internal
+    scheduling is based on this clock, which isn't affected when
+    the system clock is set.
+======================================================================*/
+static inline uint64_t mono_nsec (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
@@ -0,0 +1,680 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  gpiosim_bench.c
+
+  A load test for the main loop, which needs no real GPIO. It uses the
+    kernel's gpio-sim module to create a simulated GPIO chip, through
+    configfs, and runs pi-button-to-kbd on its lines. Then it "presses"
+    the buttons, by changing the pulls on the lines, at a set rate,
+    optionally with a burst of contact bounce on each press and
+    release. When it has finished, it stops the program, and reports
+    how many presses got through, how much CPU time the program used,
+    and the latency figures the program reports with --verbose (and
+    --latency, if the sink is uinput).
+
+  The buttons are active low, like the default EDGE in main.c: a line
+    is pulled down while its button is pressed.
+
+  This has to be run as root, with the gpio-sim module available, and
+    the GPIO sysfs interface enabled in the kernel. 'make bench' builds
+    and runs it.
+
+  With --fifo, no kernel support is needed at all. The harness builds a
+    fake GPIO tree in a temporary directory, laid out like 
+    /sys/class/gpio, except that each pin's 'value' is a FIFO, and runs
+    the program with --gpio-root pointing at it. Each change to a line
+    is written to its FIFO as the new state, "0\n" or "1\n". With
+    --flood as well, each press and release is as close to the one 
+    before as the program's bounce lock-out allows, and its bounces are
+    written all at once, so the debouncing gets bursts of edges far 
+    faster than real switches make, and still has presses to accept; 
+    the result is the presses accepted per second. With --stream 
+    instead, every change is written straight after the one before, as
+    fast as the program will read them, and the result is the edges it
+    read per second. The program reads all that is waiting in a FIFO 
+    at once, and acts on the last of it, so it wakes for fewer edges 
+    than it reads; hardly any presses get past the lock-out.
+
+  With --virtual, there is no GPIO at all: the changes are written to a
+    recording, which the program replays with --replay, on its virtual
+    clock. Hours of button presses take seconds, and the CPU time per
+    edge is just that of the program's debouncing and output.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <glob.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include "defs.h"
+#include "record.h"
+
+#define SIM_ROOT "/sys/kernel/config/gpio-sim/pbk-bench"
+
+// MAX_LINES is the most simulated buttons; the program can't watch more
+//   than MAX_PINS anyway
+#define MAX_LINES MAX_PINS
+
+// The program ignores presses in its first second, so we wait a little
+//   longer than that before starting
+#define SETTLE_MSEC 1500
+
+// The number of the first line in a fake GPIO tree
+#define FIFO_BASE 100
+
+// With --flood, a line changes this often: a little longer than the
+//   program's bounce lock-out (BOUNCE_MSEC in main.c), so that every
+//   press and release gets past it
+#define FLOOD_SPACING_MSEC 350
+
+// A single change to a line, at a time relative to the start
+typedef struct _Edge
+  {
+  uint64_t at;            // Nanoseconds from the start
+  int line;
+  int pressed;
+  } Edge;
+
+// Keys sent by each line, which don't matter much, as long as each is a
+//   single key
+static const char *keys[] = {"A", "B", "C", "D", "E", "F", "G", "H",
+  "I", "J", "K", "L", "M", "N", "O", "P"};
+
+static int pull_fds[MAX_LINES];  // Or the lines' FIFOs, with --fifo
+static BOOL use_fifo = FALSE;
+static BOOL use_virtual = FALSE;
+static char tree[] = "/tmp/gpiosim-bench-tree-XXXXXX";
+
+/*======================================================================
+  dbglog
+  Needed by defs.h; the harness has nothing to log
+======================================================================*/
+void dbglog (const char *fmt,...)
+  {
+  }
+
+/*======================================================================
+  write_file
+  Write a string to a file in configfs or sysfs. Any failure is fatal,
+    except when tidying up.
+======================================================================*/
+static BOOL write_file (const char *file, const char *text, BOOL fatal)
+  {
+  int fd = open (file, O_WRONLY);
+  if (fd >= 0 && write (fd, text, strlen (text)) == strlen (text))
+    {
+    close (fd);
+    return TRUE;
+    }
+  if (fd >= 0) close (fd);
+  if (!fatal) return FALSE;
+  fprintf (stderr, "Can't write to %s: %s\n", file, strerror (errno));
+  exit (-1);
+  }
+
+/*======================================================================
+  read_file
+  Read the first line of a file in configfs or sysfs, without the EOL.
+    Any failure is fatal.
+======================================================================*/
+static void read_file (const char *file, char *text, size_t len)
+  {
+  FILE *f = fopen (file, "r");
+  if (!f || !fgets (text, len, f))
+    {
+    fprintf (stderr, "Can't read %s: %s\n", file, strerror (errno));
+    exit (-1);
+    }
+  fclose (f);
+  text[strcspn (text, "\n")] = 0;
+  }
+
+/*======================================================================
+  sim_remove
+  Remove the simulated chip, if it is there
+======================================================================*/
+static void sim_remove (void)
+  {
+  write_file (SIM_ROOT "/live", "0", FALSE);
+  rmdir (SIM_ROOT "/bank0");
+  rmdir (SIM_ROOT);
+  }
+
+/*======================================================================
+  sim_create
+  Create a simulated chip with 'nlines' lines, all pulled up, and open
+    the pull attribute of each line. Returns the sysfs number of the
+    first line.
+======================================================================*/
+static int sim_create (int nlines)
+  {
+  char path[300], text[100];
+  system ("modprobe gpio-sim 2>/dev/null");
+  sim_remove();
+  if (mkdir (SIM_ROOT, 0755) || mkdir (SIM_ROOT "/bank0", 0755))
+    {
+    fprintf (stderr, "Can't create %s: %s (is gpio-sim loaded?)\n",
+      SIM_ROOT, strerror (errno));
+    exit (-1);
+    }
+  snprintf (text, sizeof (text), "%d", nlines);
+  write_file (SIM_ROOT "/bank0/num_lines", text, TRUE);
+  write_file (SIM_ROOT "/live", "1", TRUE);
+
+  char dev_name[100], chip_name[100];
+  read_file (SIM_ROOT "/dev_name", dev_name, sizeof (dev_name));
+  read_file (SIM_ROOT "/bank0/chip_name", chip_name, sizeof (chip_name));
+
+  // The legacy sysfs interface numbers the lines from the chip's base
+  snprintf (path, sizeof (path),
+    "/sys/devices/platform/%s/%s/gpio/gpiochip*/base", dev_name, chip_name);
+  glob_t g;
+  if (glob (path, 0, NULL, &g) || g.gl_pathc != 1)
+    {
+    fprintf (stderr, "Can't find the sysfs base of %s "
+      "(is CONFIG_GPIO_SYSFS enabled?)\n", chip_name);
+    exit (-1);
+    }
+  read_file (g.gl_pathv[0], text, sizeof (text));
+  globfree (&g);
+
+  for (int i = 0; i < nlines; i++)
+    {
+    snprintf (path, sizeof (path),
+      "/sys/devices/platform/%s/%s/sim_gpio%d/pull", dev_name,
+      chip_name, i);
+    pull_fds[i] = open (path, O_WRONLY);
+    if (pull_fds[i] < 0)
+      {
+      fprintf (stderr, "Can't open %s: %s\n", path, strerror (errno));
+      exit (-1);
+      }
+    }
+  return atoi (text);
+  }
+
+/*======================================================================
+  fifo_path
+======================================================================*/
+static void fifo_path (char *path, size_t len, int pin, const char *file)
+  {
+  snprintf (path, len, "%s/gpio%d/%s", tree, pin, file);
+  }
+
+/*======================================================================
+  fifo_create
+  Create a fake GPIO tree, with a FIFO as the 'value' of each line, and
+    open the FIFOs. The lines are numbered from 'base'.
+======================================================================*/
+static void fifo_create (int nlines, int base)
+  {
+  char path[300];
+  if (!mkdtemp (tree))
+    {
+    fprintf (stderr, "Can't create %s: %s\n", tree, strerror (errno));
+    exit (-1);
+    }
+  snprintf (path, sizeof (path), "%s/export", tree);
+  close (creat (path, 0644));
+  snprintf (path, sizeof (path), "%s/unexport", tree);
+  close (creat (path, 0644));
+  for (int i = 0; i < nlines; i++)
+    {
+    snprintf (path, sizeof (path), "%s/gpio%d", tree, base + i);
+    mkdir (path, 0755);
+    fifo_path (path, sizeof (path), base + i, "direction");
+    close (creat (path, 0644));
+    fifo_path (path, sizeof (path), base + i, "edge");
+    close (creat (path, 0644));
+    fifo_path (path, sizeof (path), base + i, "value");
+    // Opening the FIFO for reading and writing doesn't wait for the 
+    //   program to open it
+    if (mkfifo (path, 0644) || (pull_fds[i] = open (path, O_RDWR)) < 0)
+      {
+      fprintf (stderr, "Can't create %s: %s\n", path, strerror (errno));
+      exit (-1);
+      }
+    }
+  }
+
+/*======================================================================
+  fifo_remove
+======================================================================*/
+static void fifo_remove (int nlines, int base)
+  {
+  const char *files[] = {"direction", "edge", "value"};
+  char path[300];
+  for (int i = 0; i < nlines; i++)
+    {
+    for (int f = 0; f < 3; f++)
+      {
+      fifo_path (path, sizeof (path), base + i, files[f]);
+      unlink (path);
+      }
+    snprintf (path, sizeof (path), "%s/gpio%d", tree, base + i);
+    rmdir (path);
+    }
+  snprintf (path, sizeof (path), "%s/export", tree);
+  unlink (path);
+  snprintf (path, sizeof (path), "%s/unexport", tree);
+  unlink (path);
+  rmdir (tree);
+  }
+
+/*======================================================================
+  fifo_wait_read
+  Wait until the program has read everything written to the FIFOs
+======================================================================*/
+static void fifo_wait_read (int nlines)
+  {
+  for (int i = 0; i < nlines; i++)
+    {
+    int n;
+    while (ioctl (pull_fds[i], FIONREAD, &n) == 0 && n > 0)
+      usleep (100);
+    }
+  }
+
+/*======================================================================
+  set_line
+  Press or release the button on a line. A FIFO blocks if the program
+    falls behind, which holds the harness back.
+======================================================================*/
+static void set_line (int line, int pressed)
+  {
+  if (use_fifo)
+    {
+    write (pull_fds[line], pressed ? "0\n" : "1\n", 2);
+    return;
+    }
+  const char *pull = pressed ? "pull-down" : "pull-up";
+  pwrite (pull_fds[line], pull, strlen (pull), 0);
+  }
+
+/*======================================================================
+  compare_edges
+======================================================================*/
+static int compare_edges (const void *a, const void *b)
+  {
+  uint64_t x = ((const Edge *)a)->at;
+  uint64_t y = ((const Edge *)b)->at;
+  return x < y ? -1 : x > y;
+  }
+
+/*======================================================================
+  make_edges
+  Work out every change to every line. Each line is pressed 'rate'
+    times a second, with the lines spread evenly across each period.
+    A press or release starts with 'bounces' bounces, each of which is
+    a change to the new state and back again, all 'gap' microseconds
+    apart, and a button is held for 'hold' milliseconds.
+    Returns the number of edges, in time order.
+======================================================================*/
+static int make_edges (Edge **edges, int nlines, double rate,
+    double seconds, int bounces, int gap, int hold, int *presses)
+  {
+  uint64_t period = 1e9 / rate;
+  int per_line = seconds * rate;
+  int per_change = 1 + 2 * bounces;
+  int n = nlines * per_line * 2 * per_change;
+  Edge *e = malloc (n * sizeof (Edge));
+  int k = 0;
+  for (int line = 0; line < nlines; line++)
+    {
+    for (int p = 0; p < per_line; p++)
+      {
+      uint64_t t = p * period + line * period / nlines;
+      for (int change = 0; change < 2; change++)
+        {
+        int pressed = change == 0;
+        uint64_t at = t + (change ? hold * 1000000ULL : 0);
+        for (int b = 0; b < per_change; b++)
+          {
+          // Bouncing goes to the new state and back, ending up in the
+          //   new state
+          e[k].at = at + b * gap * 1000ULL;
+          e[k].line = line;
+          e[k].pressed = (b % 2 == 0) ? pressed : !pressed;
+          k++;
+          }
+        }
+      }
+    }
+  qsort (e, n, sizeof (Edge), compare_edges);
+  *edges = e;
+  *presses = nlines * per_line;
+  return n;
+  }
+
+/*======================================================================
+  write_recording
+  Write the changes to the lines as a recording for --replay, starting
+    after the program's first second. The recording has only the edges;
+    the program works out what it would have read after each one.
+======================================================================*/
+static void write_recording (const char *file, const Edge *edges, 
+    int nedges, int base)
+  {
+  FILE *f = fopen (file, "wb");
+  if (!f)
+    {
+    fprintf (stderr, "Can't write %s: %s\n", file, strerror (errno));
+    exit (-1);
+    }
+  RecordHeader h;
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, RECORD_MAGIC, 4);
+  h.version = RECORD_VERSION;
+  fwrite (&h, sizeof (h), 1, f);
+  for (int i = 0; i < nedges; i++)
+    {
+    EdgeRecord r;
+    r.nsec = SETTLE_MSEC * 1000000ULL + edges[i].at;
+    r.pin = base + edges[i].line;
+    r.flags = edges[i].pressed ? 0 : RECORD_LEVEL;
+    fwrite (&r, sizeof (r), 1, f);
+    }
+  fclose (f);
+  }
+
+/*======================================================================
+  write_config
+  Write a configuration file mapping each line to a key
+======================================================================*/
+static void write_config (const char *file, int base, int nlines)
+  {
+  FILE *f = fopen (file, "w");
+  if (!f)
+    {
+    fprintf (stderr, "Can't write %s: %s\n", file, strerror (errno));
+    exit (-1);
+    }
+  fprintf (f, "# Written by gpiosim_bench\n");
+  for (int i = 0; i < nlines; i++)
+    fprintf (f, "%d %s\n", base + i, keys[i]);
+  fclose (f);
+  }
+
+/*======================================================================
+  show_usage
+======================================================================*/
+static void show_usage (const char *argv0)
+  {
+  printf ("Usage: %s [options]\n", argv0);
+  printf ("  -b, --bounces=N     contact bounces on each change (0)\n");
+  printf ("  -d, --duration=SEC  how long to press buttons for (10)\n");
+  printf ("  -f, --fifo          use a fake GPIO tree made of FIFOs,\n");
+  printf ("                        rather than gpio-sim\n");
+  printf ("  -F, --flood         with --fifo, press each button as often\n");
+  printf ("                        as the bounce lock-out allows, with no\n");
+  printf ("                        gap between bounces; this sets --rate,\n");
+  printf ("                        --hold and --gap\n");
+  printf ("  -S, --stream        with --fifo, write the changes back to\n");
+  printf ("                        back, and report the edges read\n");
+  printf ("                        per second\n");
+  printf ("  -g, --gap=USEC      time between bounces (200)\n");
+  printf ("  -H, --hold=MSEC     how long each button is held (50)\n");
+  printf ("  -l, --lines=N       number of buttons (4)\n");
+  printf ("  -p, --program=FILE  the program to test "
+    "(./pi-button-to-kbd)\n");
+  printf ("  -r, --rate=N        presses per second on each button (2)\n");
+  printf ("  -s, --sink=SINK     sink for the program (json); with\n");
+  printf ("                        uinput, --latency is used as well\n");
+  printf ("  -v, --virtual       replay the presses on the program's\n");
+  printf ("                        virtual clock, rather than in real time\n");
+  }
+
+/*======================================================================
+  main
+======================================================================*/
+int main (int argc, char **argv)
+  {
+  int nlines = 4;
+  double rate = 2;
+  double seconds = 10;
+  int bounces = 0;
+  int gap = 200;
+  int hold = 50;
+  const char *program = "./pi-button-to-kbd";
+  const char *sink = "json";
+  BOOL flood = FALSE;
+  BOOL stream = FALSE;
+
+  static struct option long_options[] =
+    {
+      {"bounces", required_argument, NULL, 'b'},
+      {"duration", required_argument, NULL, 'd'},
+      {"fifo", no_argument, NULL, 'f'},
+      {"flood", no_argument, NULL, 'F'},
+      {"gap", required_argument, NULL, 'g'},
+      {"hold", required_argument, NULL, 'H'},
+      {"help", no_argument, NULL, 'h'},
+      {"lines", required_argument, NULL, 'l'},
+      {"program", required_argument, NULL, 'p'},
+      {"rate", required_argument, NULL, 'r'},
+      {"sink", required_argument, NULL, 's'},
+      {"stream", no_argument, NULL, 'S'},
+      {"virtual", no_argument, NULL, 'v'},
+      {0, 0, 0, 0}
+    };
+
+  int opt;
+  while ((opt = getopt_long (argc, argv, "b:d:fFg:hH:l:p:r:s:Sv",
+      long_options, NULL)) != -1)
+    {
+    switch (opt)
+      {
+      case 'b': bounces = atoi (optarg); break;
+      case 'd': seconds = atof (optarg); break;
+      case 'f': use_fifo = TRUE; break;
+      case 'F': flood = TRUE; break;
+      case 'g': gap = atoi (optarg); break;
+      case 'H': hold = atoi (optarg); break;
+      case 'h': show_usage (argv[0]); exit (0);
+      case 'l': nlines = atoi (optarg); break;
+      case 'p': program = optarg; break;
+      case 'r': rate = atof (optarg); break;
+      case 's': sink = optarg; break;
+      case 'S': stream = TRUE; break;
+      case 'v': use_virtual = TRUE; break;
+      default: show_usage (argv[0]); exit (-1);
+      }
+    }
+  if (nlines < 1 || nlines > MAX_LINES || rate <= 0 || seconds <= 0
+       || bounces < 0 || gap < 1 || hold < 1)
+    {
+    fprintf (stderr, "%s: bad option value\n", argv[0]);
+    exit (-1);
+    }
+  if ((flood || stream) && !use_fifo)
+    {
+    fprintf (stderr, "%s: --flood and --stream need --fifo\n", argv[0]);
+    exit (-1);
+    }
+  if (flood && stream)
+    {
+    fprintf (stderr, "%s: --flood and --stream can't be used together\n", 
+      argv[0]);
+    exit (-1);
+    }
+  if (flood)
+    {
+    hold = FLOOD_SPACING_MSEC;
+    rate = 1000.0 / (2 * FLOOD_SPACING_MSEC);
+    gap = 1;
+    }
+  if (use_virtual && (use_fifo || strcmp (sink, "uinput") == 0))
+    {
+    fprintf (stderr, "%s: --virtual can't be used with --fifo or the "
+      "uinput sink\n", argv[0]);
+    exit (-1);
+    }
+  if ((2 * bounces * gap) / 1000 >= hold || hold * 1e6 >= 1e9 / rate)
+    {
+    fprintf (stderr, "%s: presses overlap at this rate\n", argv[0]);
+    exit (-1);
+    }
+
+  Edge *edges;
+  int presses;
+  int nedges = make_edges (&edges, nlines, rate, seconds, bounces, gap,
+    hold, &presses);
+
+  int base = FIFO_BASE;
+  char recording[] = "/tmp/gpiosim-bench-rec-XXXXXX";
+  if (use_virtual)
+    {
+    close (mkstemp (recording));
+    write_recording (recording, edges, nedges, base);
+    }
+  else if (use_fifo)
+    fifo_create (nlines, base);
+  else
+    base = sim_create (nlines);
+  char config[] = "/tmp/gpiosim-bench-XXXXXX";
+  close (mkstemp (config));
+  write_config (config, base, nlines);
+  char log[] = "/tmp/gpiosim-bench-log-XXXXXX";
+  int log_fd = mkstemp (log);
+
+  BOOL probe = strcmp (sink, "uinput") == 0;
+  pid_t pid = fork();
+  if (pid == 0)
+    {
+    dup2 (log_fd, 2);
+    int null_fd = open ("/dev/null", O_WRONLY);
+    dup2 (null_fd, 1);
+    char sink_opt[200];
+    snprintf (sink_opt, sizeof (sink_opt), "--sink=%s", sink);
+    const char *args[10] = {program, "--config", config, sink_opt, 
+      "--verbose"};
+    int nargs = 5;
+    if (probe) args[nargs++] = "--latency";
+    if (use_fifo)
+      {
+      args[nargs++] = "--gpio-root";
+      args[nargs++] = tree;
+      }
+    if (use_virtual)
+      {
+      args[nargs++] = "--replay";
+      args[nargs++] = recording;
+      }
+    execv (program, (char **)args);
+    fprintf (stderr, "Can't run %s: %s\n", program, strerror (errno));
+    _exit (-1);
+    }
+
+  printf ("%d lines, %.1f presses/s each, %d bounces %d us apart, "
+    "%.1f s%s\n", nlines, rate, bounces, gap, seconds, 
+    flood ? ", flooded" : stream ? ", streamed" 
+    : use_virtual ? ", virtual" : "");
+  // A replay needs no help from us, and stops by itself
+  if (!use_virtual) usleep (SETTLE_MSEC * 1000);
+  uint64_t start = mono_nsec();
+  uint64_t late_max = 0;
+  for (int i = 0; i < nedges && !use_virtual; i++)
+    {
+    // The bounces of a flood go straight after the change they belong 
+    //   to; in a stream, everything does
+    if (stream || (flood && i > 0 && edges[i].line == edges[i - 1].line
+         && edges[i].at - edges[i - 1].at <= gap * 1000ULL))
+      {
+      set_line (edges[i].line, edges[i].pressed);
+      continue;
+      }
+    uint64_t at = start + edges[i].at;
+    struct timespec ts = {at / 1000000000, at % 1000000000};
+    clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    uint64_t late = mono_nsec() - at;
+    if (late > late_max) late_max = late;
+    set_line (edges[i].line, edges[i].pressed);
+    }
+  // A stream is timed until the program has read the last of it; most
+  //   of it will have been waiting in the FIFOs
+  uint64_t stream_end = 0;
+  if (stream)
+    {
+    fifo_wait_read (nlines);
+    stream_end = mono_nsec();
+    }
+  int status;
+  struct rusage ru;
+  if (!use_virtual)
+    {
+    // Let the last presses get through before stopping the program
+    usleep (SETTLE_MSEC * 1000);
+    kill (pid, SIGTERM);
+    }
+  wait4 (pid, &status, 0, &ru);
+  double elapsed = (mono_nsec() - start) / 1e9;
+  if (!use_virtual)
+    elapsed -= SETTLE_MSEC / 1000.0;
+  if (stream)
+    elapsed = (stream_end - start) / 1e9;
+  if (use_virtual)
+    unlink (recording);
+  else
+    {
+    for (int i = 0; i < nlines; i++) close (pull_fds[i]);
+    if (use_fifo)
+      fifo_remove (nlines, base);
+    else
+      sim_remove();
+    }
+  unlink (config);
+
+  // Pick the program's own figures out of what it wrote to stderr
+  unsigned long long accepted = 0, seen = 0, bounced = 0, rejected = 0;
+  FILE *f = fdopen (log_fd, "r");
+  rewind (f);
+  char line[300];
+  printf ("  edges %d (%.0f/s), presses %d", nedges, nedges / elapsed, 
+    presses);
+  if (flood || stream || use_virtual)
+    printf ("\n");
+  else
+    printf (", harness at most %.3f ms late\n", late_max / 1e6);
+  while (fgets (line, sizeof (line), f))
+    {
+    sscanf (line, "%llu presses passed", &accepted);
+    if (sscanf (line, "Edges: %llu seen, %llu in the bounce lock-out, "
+         "%llu settled", &seen, &bounced, &rejected) == 3) continue;
+    if (strstr (line, "presses") || strstr (line, "Latency")
+         || strstr (line, "Replayed")
+         || strstr (line, "  "))
+      printf ("  %s", line);
+    }
+  fclose (f);
+  unlink (log);
+
+  double cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+    + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  printf ("  accepted %llu of %d presses; of %llu edges seen, %llu bounce "
+    "edges rejected\n", accepted, presses, seen, bounced + rejected);
+  printf ("    (%llu in the bounce lock-out, %llu settled back)\n", 
+    bounced, rejected);
+  if (stream)
+    printf ("  %.0f edges read per second, %.0f acted on\n", 
+      nedges / elapsed, seen / elapsed);
+  if (flood || stream)
+    printf ("  %.1f presses accepted per second\n", accepted / elapsed);
+  printf ("  CPU %.3f s (user %.3f, system %.3f), %.1f us per edge\n",
+    cpu, ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6, cpu * 1e6 / nedges);
+  return 0;
+  }
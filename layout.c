@@ -0,0 +1,475 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  layout.c
+
+  Translation tables from characters to keystrokes, for the keyboard
+    layouts we know about. The tables are indexed by character, so
+    converting text is just a table lookup per character. The names
+    of the layouts are the same as the XKB names, so they should match
+    whatever the system is set up to use.
+
+  Only the characters that can be typed with at most Shift and AltGr
+    are included. To add a layout, add its tables and an entry in
+    'layouts'.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <linux/input.h>
+#include "layout.h"
+
+static const LayoutKey us_ascii[128] =
+  {
+  ['\t'] = {KEY_TAB, 0},
+  ['\n'] = {KEY_ENTER, 0},
+  [' '] = {KEY_SPACE, 0},
+  ['!'] = {KEY_1, LAYOUT_SHIFT},
+  ['"'] = {KEY_APOSTROPHE, LAYOUT_SHIFT},
+  ['#'] = {KEY_3, LAYOUT_SHIFT},
+  ['$'] = {KEY_4, LAYOUT_SHIFT},
+  ['%'] = {KEY_5, LAYOUT_SHIFT},
+  ['&'] = {KEY_7, LAYOUT_SHIFT},
+  ['\''] = {KEY_APOSTROPHE, 0},
+  ['('] = {KEY_9, LAYOUT_SHIFT},
+  [')'] = {KEY_0, LAYOUT_SHIFT},
+  ['*'] = {KEY_8, LAYOUT_SHIFT},
+  ['+'] = {KEY_EQUAL, LAYOUT_SHIFT},
+  [','] = {KEY_COMMA, 0},
+  ['-'] = {KEY_MINUS, 0},
+  ['.'] = {KEY_DOT, 0},
+  ['/'] = {KEY_SLASH, 0},
+  ['0'] = {KEY_0, 0},
+  ['1'] = {KEY_1, 0},
+  ['2'] = {KEY_2, 0},
+  ['3'] = {KEY_3, 0},
+  ['4'] = {KEY_4, 0},
+  ['5'] = {KEY_5, 0},
+  ['6'] = {KEY_6, 0},
+  ['7'] = {KEY_7, 0},
+  ['8'] = {KEY_8, 0},
+  ['9'] = {KEY_9, 0},
+  [':'] = {KEY_SEMICOLON, LAYOUT_SHIFT},
+  [';'] = {KEY_SEMICOLON, 0},
+  ['<'] = {KEY_COMMA, LAYOUT_SHIFT},
+  ['='] = {KEY_EQUAL, 0},
+  ['>'] = {KEY_DOT, LAYOUT_SHIFT},
+  ['?'] = {KEY_SLASH, LAYOUT_SHIFT},
+  ['@'] = {KEY_2, LAYOUT_SHIFT},
+  ['A'] = {KEY_A, LAYOUT_SHIFT},
+  ['B'] = {KEY_B, LAYOUT_SHIFT},
+  ['C'] = {KEY_C, LAYOUT_SHIFT},
+  ['D'] = {KEY_D, LAYOUT_SHIFT},
+  ['E'] = {KEY_E, LAYOUT_SHIFT},
+  ['F'] = {KEY_F, LAYOUT_SHIFT},
+  ['G'] = {KEY_G, LAYOUT_SHIFT},
+  ['H'] = {KEY_H, LAYOUT_SHIFT},
+  ['I'] = {KEY_I, LAYOUT_SHIFT},
+  ['J'] = {KEY_J, LAYOUT_SHIFT},
+  ['K'] = {KEY_K, LAYOUT_SHIFT},
+  ['L'] = {KEY_L, LAYOUT_SHIFT},
+  ['M'] = {KEY_M, LAYOUT_SHIFT},
+  ['N'] = {KEY_N, LAYOUT_SHIFT},
+  ['O'] = {KEY_O, LAYOUT_SHIFT},
+  ['P'] = {KEY_P, LAYOUT_SHIFT},
+  ['Q'] = {KEY_Q, LAYOUT_SHIFT},
+  ['R'] = {KEY_R, LAYOUT_SHIFT},
+  ['S'] = {KEY_S, LAYOUT_SHIFT},
+  ['T'] = {KEY_T, LAYOUT_SHIFT},
+  ['U'] = {KEY_U, LAYOUT_SHIFT},
+  ['V'] = {KEY_V, LAYOUT_SHIFT},
+  ['W'] = {KEY_W, LAYOUT_SHIFT},
+  ['X'] = {KEY_X, LAYOUT_SHIFT},
+  ['Y'] = {KEY_Y, LAYOUT_SHIFT},
+  ['Z'] = {KEY_Z, LAYOUT_SHIFT},
+  ['['] = {KEY_LEFTBRACE, 0},
+  ['\\'] = {KEY_BACKSLASH, 0},
+  [']'] = {KEY_RIGHTBRACE, 0},
+  ['^'] = {KEY_6, LAYOUT_SHIFT},
+  ['_'] = {KEY_MINUS, LAYOUT_SHIFT},
+  ['`'] = {KEY_GRAVE, 0},
+  ['a'] = {KEY_A, 0},
+  ['b'] = {KEY_B, 0},
+  ['c'] = {KEY_C, 0},
+  ['d'] = {KEY_D, 0},
+  ['e'] = {KEY_E, 0},
+  ['f'] = {KEY_F, 0},
+  ['g'] = {KEY_G, 0},
+  ['h'] = {KEY_H, 0},
+  ['i'] = {KEY_I, 0},
+  ['j'] = {KEY_J, 0},
+  ['k'] = {KEY_K, 0},
+  ['l'] = {KEY_L, 0},
+  ['m'] = {KEY_M, 0},
+  ['n'] = {KEY_N, 0},
+  ['o'] = {KEY_O, 0},
+  ['p'] = {KEY_P, 0},
+  ['q'] = {KEY_Q, 0},
+  ['r'] = {KEY_R, 0},
+  ['s'] = {KEY_S, 0},
+  ['t'] = {KEY_T, 0},
+  ['u'] = {KEY_U, 0},
+  ['v'] = {KEY_V, 0},
+  ['w'] = {KEY_W, 0},
+  ['x'] = {KEY_X, 0},
+  ['y'] = {KEY_Y, 0},
+  ['z'] = {KEY_Z, 0},
+  ['{'] = {KEY_LEFTBRACE, LAYOUT_SHIFT},
+  ['|'] = {KEY_BACKSLASH, LAYOUT_SHIFT},
+  ['}'] = {KEY_RIGHTBRACE, LAYOUT_SHIFT},
+  ['~'] = {KEY_GRAVE, LAYOUT_SHIFT}
+  };
+
+static const LayoutKey gb_ascii[128] =
+  {
+  ['\t'] = {KEY_TAB, 0},
+  ['\n'] = {KEY_ENTER, 0},
+  [' '] = {KEY_SPACE, 0},
+  ['!'] = {KEY_1, LAYOUT_SHIFT},
+  ['"'] = {KEY_2, LAYOUT_SHIFT},
+  ['#'] = {KEY_BACKSLASH, 0},
+  ['$'] = {KEY_4, LAYOUT_SHIFT},
+  ['%'] = {KEY_5, LAYOUT_SHIFT},
+  ['&'] = {KEY_7, LAYOUT_SHIFT},
+  ['\''] = {KEY_APOSTROPHE, 0},
+  ['('] = {KEY_9, LAYOUT_SHIFT},
+  [')'] = {KEY_0, LAYOUT_SHIFT},
+  ['*'] = {KEY_8, LAYOUT_SHIFT},
+  ['+'] = {KEY_EQUAL, LAYOUT_SHIFT},
+  [','] = {KEY_COMMA, 0},
+  ['-'] = {KEY_MINUS, 0},
+  ['.'] = {KEY_DOT, 0},
+  ['/'] = {KEY_SLASH, 0},
+  ['0'] = {KEY_0, 0},
+  ['1'] = {KEY_1, 0},
+  ['2'] = {KEY_2, 0},
+  ['3'] = {KEY_3, 0},
+  ['4'] = {KEY_4, 0},
+  ['5'] = {KEY_5, 0},
+  ['6'] = {KEY_6, 0},
+  ['7'] = {KEY_7, 0},
+  ['8'] = {KEY_8, 0},
+  ['9'] = {KEY_9, 0},
+  [':'] = {KEY_SEMICOLON, LAYOUT_SHIFT},
+  [';'] = {KEY_SEMICOLON, 0},
+  ['<'] = {KEY_COMMA, LAYOUT_SHIFT},
+  ['='] = {KEY_EQUAL, 0},
+  ['>'] = {KEY_DOT, LAYOUT_SHIFT},
+  ['?'] = {KEY_SLASH, LAYOUT_SHIFT},
+  ['@'] = {KEY_APOSTROPHE, LAYOUT_SHIFT},
+  ['A'] = {KEY_A, LAYOUT_SHIFT},
+  ['B'] = {KEY_B, LAYOUT_SHIFT},
+  ['C'] = {KEY_C, LAYOUT_SHIFT},
+  ['D'] = {KEY_D, LAYOUT_SHIFT},
+  ['E'] = {KEY_E, LAYOUT_SHIFT},
+  ['F'] = {KEY_F, LAYOUT_SHIFT},
+  ['G'] = {KEY_G, LAYOUT_SHIFT},
+  ['H'] = {KEY_H, LAYOUT_SHIFT},
+  ['I'] = {KEY_I, LAYOUT_SHIFT},
+  ['J'] = {KEY_J, LAYOUT_SHIFT},
+  ['K'] = {KEY_K, LAYOUT_SHIFT},
+  ['L'] = {KEY_L, LAYOUT_SHIFT},
+  ['M'] = {KEY_M, LAYOUT_SHIFT},
+  ['N'] = {KEY_N, LAYOUT_SHIFT},
+  ['O'] = {KEY_O, LAYOUT_SHIFT},
+  ['P'] = {KEY_P, LAYOUT_SHIFT},
+  ['Q'] = {KEY_Q, LAYOUT_SHIFT},
+  ['R'] = {KEY_R, LAYOUT_SHIFT},
+  ['S'] = {KEY_S, LAYOUT_SHIFT},
+  ['T'] = {KEY_T, LAYOUT_SHIFT},
+  ['U'] = {KEY_U, LAYOUT_SHIFT},
+  ['V'] = {KEY_V, LAYOUT_SHIFT},
+  ['W'] = {KEY_W, LAYOUT_SHIFT},
+  ['X'] = {KEY_X, LAYOUT_SHIFT},
+  ['Y'] = {KEY_Y, LAYOUT_SHIFT},
+  ['Z'] = {KEY_Z, LAYOUT_SHIFT},
+  ['['] = {KEY_LEFTBRACE, 0},
+  ['\\'] = {KEY_102ND, 0},
+  [']'] = {KEY_RIGHTBRACE, 0},
+  ['^'] = {KEY_6, LAYOUT_SHIFT},
+  ['_'] = {KEY_MINUS, LAYOUT_SHIFT},
+  ['`'] = {KEY_GRAVE, 0},
+  ['a'] = {KEY_A, 0},
+  ['b'] = {KEY_B, 0},
+  ['c'] = {KEY_C, 0},
+  ['d'] = {KEY_D, 0},
+  ['e'] = {KEY_E, 0},
+  ['f'] = {KEY_F, 0},
+  ['g'] = {KEY_G, 0},
+  ['h'] = {KEY_H, 0},
+  ['i'] = {KEY_I, 0},
+  ['j'] = {KEY_J, 0},
+  ['k'] = {KEY_K, 0},
+  ['l'] = {KEY_L, 0},
+  ['m'] = {KEY_M, 0},
+  ['n'] = {KEY_N, 0},
+  ['o'] = {KEY_O, 0},
+  ['p'] = {KEY_P, 0},
+  ['q'] = {KEY_Q, 0},
+  ['r'] = {KEY_R, 0},
+  ['s'] = {KEY_S, 0},
+  ['t'] = {KEY_T, 0},
+  ['u'] = {KEY_U, 0},
+  ['v'] = {KEY_V, 0},
+  ['w'] = {KEY_W, 0},
+  ['x'] = {KEY_X, 0},
+  ['y'] = {KEY_Y, 0},
+  ['z'] = {KEY_Z, 0},
+  ['{'] = {KEY_LEFTBRACE, LAYOUT_SHIFT},
+  ['|'] = {KEY_102ND, LAYOUT_SHIFT},
+  ['}'] = {KEY_RIGHTBRACE, LAYOUT_SHIFT},
+  ['~'] = {KEY_BACKSLASH, LAYOUT_SHIFT}
+  };
+
+static const LayoutExtra gb_extra[] =
+  {
+  {0x00A3, {KEY_3, LAYOUT_SHIFT}}, // £
+  {0x00AC, {KEY_GRAVE, LAYOUT_SHIFT}}, // ¬
+  {0x20AC, {KEY_4, LAYOUT_ALTGR}}, // €
+  {0, {0, 0}}
+  };
+
+static const LayoutKey de_ascii[128] =
+  {
+  ['\t'] = {KEY_TAB, 0},
+  ['\n'] = {KEY_ENTER, 0},
+  [' '] = {KEY_SPACE, 0},
+  ['!'] = {KEY_1, LAYOUT_SHIFT},
+  ['"'] = {KEY_2, LAYOUT_SHIFT},
+  ['#'] = {KEY_BACKSLASH, 0},
+  ['$'] = {KEY_4, LAYOUT_SHIFT},
+  ['%'] = {KEY_5, LAYOUT_SHIFT},
+  ['&'] = {KEY_6, LAYOUT_SHIFT},
+  ['\''] = {KEY_BACKSLASH, LAYOUT_SHIFT},
+  ['('] = {KEY_8, LAYOUT_SHIFT},
+  [')'] = {KEY_9, LAYOUT_SHIFT},
+  ['*'] = {KEY_RIGHTBRACE, LAYOUT_SHIFT},
+  ['+'] = {KEY_RIGHTBRACE, 0},
+  [','] = {KEY_COMMA, 0},
+  ['-'] = {KEY_SLASH, 0},
+  ['.'] = {KEY_DOT, 0},
+  ['/'] = {KEY_7, LAYOUT_SHIFT},
+  ['0'] = {KEY_0, 0},
+  ['1'] = {KEY_1, 0},
+  ['2'] = {KEY_2, 0},
+  ['3'] = {KEY_3, 0},
+  ['4'] = {KEY_4, 0},
+  ['5'] = {KEY_5, 0},
+  ['6'] = {KEY_6, 0},
+  ['7'] = {KEY_7, 0},
+  ['8'] = {KEY_8, 0},
+  ['9'] = {KEY_9, 0},
+  [':'] = {KEY_DOT, LAYOUT_SHIFT},
+  [';'] = {KEY_COMMA, LAYOUT_SHIFT},
+  ['<'] = {KEY_102ND, 0},
+  ['='] = {KEY_0, LAYOUT_SHIFT},
+  ['>'] = {KEY_102ND, LAYOUT_SHIFT},
+  ['?'] = {KEY_MINUS, LAYOUT_SHIFT},
+  ['@'] = {KEY_Q, LAYOUT_ALTGR},
+  ['A'] = {KEY_A, LAYOUT_SHIFT},
+  ['B'] = {KEY_B, LAYOUT_SHIFT},
+  ['C'] = {KEY_C, LAYOUT_SHIFT},
+  ['D'] = {KEY_D, LAYOUT_SHIFT},
+  ['E'] = {KEY_E, LAYOUT_SHIFT},
+  ['F'] = {KEY_F, LAYOUT_SHIFT},
+  ['G'] = {KEY_G, LAYOUT_SHIFT},
+  ['H'] = {KEY_H, LAYOUT_SHIFT},
+  ['I'] = {KEY_I, LAYOUT_SHIFT},
+  ['J'] = {KEY_J, LAYOUT_SHIFT},
+  ['K'] = {KEY_K, LAYOUT_SHIFT},
+  ['L'] = {KEY_L, LAYOUT_SHIFT},
+  ['M'] = {KEY_M, LAYOUT_SHIFT},
+  ['N'] = {KEY_N, LAYOUT_SHIFT},
+  ['O'] = {KEY_O, LAYOUT_SHIFT},
+  ['P'] = {KEY_P, LAYOUT_SHIFT},
+  ['Q'] = {KEY_Q, LAYOUT_SHIFT},
+  ['R'] = {KEY_R, LAYOUT_SHIFT},
+  ['S'] = {KEY_S, LAYOUT_SHIFT},
+  ['T'] = {KEY_T, LAYOUT_SHIFT},
+  ['U'] = {KEY_U, LAYOUT_SHIFT},
+  ['V'] = {KEY_V, LAYOUT_SHIFT},
+  ['W'] = {KEY_W, LAYOUT_SHIFT},
+  ['X'] = {KEY_X, LAYOUT_SHIFT},
+  ['Y'] = {KEY_Z, LAYOUT_SHIFT},
+  ['Z'] = {KEY_Y, LAYOUT_SHIFT},
+  ['['] = {KEY_8, LAYOUT_ALTGR},
+  ['\\'] = {KEY_MINUS, LAYOUT_ALTGR},
+  [']'] = {KEY_9, LAYOUT_ALTGR},
+  ['^'] = {KEY_GRAVE, LAYOUT_DEAD},
+  ['_'] = {KEY_SLASH, LAYOUT_SHIFT},
+  ['`'] = {KEY_EQUAL, LAYOUT_SHIFT | LAYOUT_DEAD},
+  ['a'] = {KEY_A, 0},
+  ['b'] = {KEY_B, 0},
+  ['c'] = {KEY_C, 0},
+  ['d'] = {KEY_D, 0},
+  ['e'] = {KEY_E, 0},
+  ['f'] = {KEY_F, 0},
+  ['g'] = {KEY_G, 0},
+  ['h'] = {KEY_H, 0},
+  ['i'] = {KEY_I, 0},
+  ['j'] = {KEY_J, 0},
+  ['k'] = {KEY_K, 0},
+  ['l'] = {KEY_L, 0},
+  ['m'] = {KEY_M, 0},
+  ['n'] = {KEY_N, 0},
+  ['o'] = {KEY_O, 0},
+  ['p'] = {KEY_P, 0},
+  ['q'] = {KEY_Q, 0},
+  ['r'] = {KEY_R, 0},
+  ['s'] = {KEY_S, 0},
+  ['t'] = {KEY_T, 0},
+  ['u'] = {KEY_U, 0},
+  ['v'] = {KEY_V, 0},
+  ['w'] = {KEY_W, 0},
+  ['x'] = {KEY_X, 0},
+  ['y'] = {KEY_Z, 0},
+  ['z'] = {KEY_Y, 0},
+  ['{'] = {KEY_7, LAYOUT_ALTGR},
+  ['|'] = {KEY_102ND, LAYOUT_ALTGR},
+  ['}'] = {KEY_0, LAYOUT_ALTGR},
+  ['~'] = {KEY_RIGHTBRACE, LAYOUT_ALTGR | LAYOUT_DEAD}
+  };
+
+static const LayoutExtra de_extra[] =
+  {
+  {0x00A7, {KEY_3, LAYOUT_SHIFT}}, // §
+  {0x00B0, {KEY_GRAVE, LAYOUT_SHIFT}}, // °
+  {0x00B2, {KEY_2, LAYOUT_ALTGR}}, // ²
+  {0x00B3, {KEY_3, LAYOUT_ALTGR}}, // ³
+  {0x00B4, {KEY_EQUAL, LAYOUT_DEAD}}, // ´
+  {0x00B5, {KEY_M, LAYOUT_ALTGR}}, // µ
+  {0x00C4, {KEY_APOSTROPHE, LAYOUT_SHIFT}}, // Ä
+  {0x00D6, {KEY_SEMICOLON, LAYOUT_SHIFT}}, // Ö
+  {0x00DC, {KEY_LEFTBRACE, LAYOUT_SHIFT}}, // Ü
+  {0x00DF, {KEY_MINUS, 0}}, // ß
+  {0x00E4, {KEY_APOSTROPHE, 0}}, // ä
+  {0x00F6, {KEY_SEMICOLON, 0}}, // ö
+  {0x00FC, {KEY_LEFTBRACE, 0}}, // ü
+  {0x20AC, {KEY_E, LAYOUT_ALTGR}}, // €
+  {0, {0, 0}}
+  };
+
+static const LayoutExtra no_extra[] =
+  {
+  {0, {0, 0}}
+  };
+
+static const Layout layouts[] =
+  {
+  {"us", us_ascii, no_extra},
+  {"gb", gb_ascii, gb_extra},
+  {"de", de_ascii, de_extra},
+  {NULL, NULL, NULL}
+  };
+
+/*======================================================================
+  layout_find
+  Find a layout by name. Returns NULL if we don't have it.
+======================================================================*/
+const Layout *layout_find (const char *name)
+  {
+  for (const Layout *l = layouts; l->name; l++)
+    {
+    if (strcasecmp (l->name, name) == 0) return l;
+    }
+  return NULL;
+  }
+
+/*======================================================================
+  layout_lookup
+  Get the keystroke that types a character, or NULL if it can't be
+    typed with this layout.
+======================================================================*/
+const LayoutKey *layout_lookup (const Layout *layout, uint32_t ch)
+  {
+  if (ch < 128)
+    return layout->ascii[ch].code ? &layout->ascii[ch] : NULL;
+  for (const LayoutExtra *e = layout->extra; e->ch; e++)
+    {
+    if (e->ch == ch) return &e->key;
+    }
+  return NULL;
+  }
+
+/*======================================================================
+  utf8_next_char
+  Decode one UTF-8 character, and advance the string pointer past it.
+    Returns 1 if a character was decoded, 0 at the end of the string,
+    and -1 if the string is not valid UTF-8.
+======================================================================*/
+int utf8_next_char (const char **s, uint32_t *ch)
+  {
+  const unsigned char *p = (const unsigned char *)*s;
+  int extra;
+  if (*p == 0) return 0;
+  if (*p < 0x80) { *ch = *p; extra = 0; }
+  else if ((*p & 0xE0) == 0xC0) { *ch = *p & 0x1F; extra = 1; }
+  else if ((*p & 0xF0) == 0xE0) { *ch = *p & 0x0F; extra = 2; }
+  else if ((*p & 0xF8) == 0xF0) { *ch = *p & 0x07; extra = 3; }
+  else return -1;
+  p++;
+  for (int i = 0; i < extra; i++, p++)
+    {
+    if ((*p & 0xC0) != 0x80) return -1;
+    *ch = (*ch << 6) | (*p & 0x3F);
+    }
+  *s = (const char *)p;
+  return 1;
+  }
+
+/*======================================================================
+  layout_char
+  The reverse of layout_lookup(): get the character typed by a key 
+    with some modifiers held, or 0 if there isn't one. Dead keys are
+    ignored. This is just a search, but there are only a few hundred
+    entries.
+======================================================================*/
+uint32_t layout_char (const Layout *layout, int code, int mods)
+  {
+  for (int ch = 0; ch < 128; ch++)
+    {
+    const LayoutKey *k = &layout->ascii[ch];
+    if (k->code == code && k->mods == mods) return ch;
+    }
+  for (const LayoutExtra *e = layout->extra; e->ch; e++)
+    {
+    if (e->key.code == code && e->key.mods == mods) return e->ch;
+    }
+  return 0;
+  }
+
+/*======================================================================
+  utf8_put_char
+  Encode a character as UTF-8. 'out' must have room for four bytes.
+    Returns the number of bytes written.
+======================================================================*/
+int utf8_put_char (uint32_t ch, char *out)
+  {
+  if (ch < 0x80)
+    {
+    out[0] = ch;
+    return 1;
+    }
+  if (ch < 0x800)
+    {
+    out[0] = 0xC0 | (ch >> 6);
+    out[1] = 0x80 | (ch & 0x3F);
+    return 2;
+    }
+  if (ch < 0x10000)
+    {
+    out[0] = 0xE0 | (ch >> 12);
+    out[1] = 0x80 | ((ch >> 6) & 0x3F);
+    out[2] = 0x80 | (ch & 0x3F);
+    return 3;
+    }
+  out[0] = 0xF0 | (ch >> 18);
+  out[1] = 0x80 | ((ch >> 12) & 0x3F);
+  out[2] = 0x80 | ((ch >> 6) & 0x3F);
+  out[3] = 0x80 | (ch & 0x3F);
+  return 4;
+  }
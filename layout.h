@@ -0,0 +1,48 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  layout.h
+
+  Keyboard layouts, for converting text to the keystrokes that would
+    type it, and back again.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#pragma once
+
+#include <stdint.h>
+
+// Modifiers needed to type a character
+#define LAYOUT_SHIFT 0x01
+#define LAYOUT_ALTGR 0x02
+// A dead key doesn't type anything until the next key is pressed. To
+//   get the character on the dead key itself, we follow it with a space
+#define LAYOUT_DEAD 0x04
+
+typedef struct _LayoutKey
+  {
+  uint16_t code; // Scan code, or 0 if the character can't be typed
+  uint16_t mods;
+  } LayoutKey;
+
+// Characters outside the ASCII range are kept in a short list
+typedef struct _LayoutExtra
+  {
+  uint32_t ch;
+  LayoutKey key;
+  } LayoutExtra;
+
+typedef struct _Layout
+  {
+  const char *name;
+  const LayoutKey *ascii;    // Indexed by character, 128 entries
+  const LayoutExtra *extra;  // Terminated by ch == 0
+  } Layout;
+
+const Layout *layout_find (const char *name);
+const LayoutKey *layout_lookup (const Layout *layout, uint32_t ch);
+int utf8_next_char (const char **s, uint32_t *ch);
+uint32_t layout_char (const Layout *layout, int code, int mods);
+int utf8_put_char (uint32_t ch, char *out);
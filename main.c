@@ -7,6 +7,7 @@
   Kevin Boone, CPL v3.0
 
 ======================================================================*/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,43 +18,30 @@
 #include <stdarg.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <linux/uinput.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
+#include "defs.h"
+#include "mapping.h"
+#include "output.h"
+#include "probe.h"
+#include "record.h"
+#include "clock.h"
+#include "stats.h"
+#include "trace.h"
+#include "usdt.h"
+#include "metrics.h"
 
 // Constants to use when we specify whether to detect the rising edge
 //   or falling edge of the GPIO state change
 #define EDGE_RISING 0x01
 #define EDGE_FALLING 0x02
 
-// CLOCK_ERROR_SECONDS is how long the elapsed time can be between two 
-//   GPIO events, before we conclude that the system clock has been adjusted, 
-//   and we need to reset the internal timer. The value needs to be large 
-//   enough that minor adjustments caused by NTP sync don't cause events to
-//   be skipped, but not so large that we don't detect problems. In practce, 
-//   in a Pi without a real-time clock, when NTP sets the date, it will 
-//   result in a sudden clock change of at least 30 years, which is easy to
-//   detect.
-#define SEC_PER_YEAR 31536000
-
-// Constants used in the keyboard mapping table. To indicate a 
-//   'key up' event, we will OR the keyboard scan code with UP (0);
-//   to indicate a keyboard down event, we will OR it with DOWN (1).
-//   DOWN needs to be larger than the largest scan code. In practice,
-//   all scan codes will fit into the lowest 8 bits. Of course, ORing
-//   a number with zero does not change it, but this idiom makes the
-//   mapping table easier to read.
-#define UP 0x0000
-#define DOWN 0x1000
-
-// The usual boolean types
-#define BOOL int
-#define TRUE 1
-#define FALSE 0
-
 // BOUNCE_MSEC is how long to lock out the button change after it has been
 //   pressed or released. It should be longer than the longest contact
 //   bounce, but short enough to allow reasonably rapid keypresses. Some
@@ -61,43 +49,39 @@
 //   particular type of switch.
 #define BOUNCE_MSEC 300 
 
-// MAX_PINS is the largest number of GPIO pins we will monitor. Using a fixed
-//   value makes the memory management less messy.
-#define MAX_PINS 16
+// SETTLE_MSEC is how long we wait after an edge, before reading the
+//   state of the pin -- see handle_edge()
+#define SETTLE_MSEC 2
 
 // Default edge detection. If the switch is active low, then we need the
 //   falling edge if we trigger on press. Or the rising edge if we trigger
 //   on release
 #define EDGE EDGE_FALLING
 
+// Where the kernel's sysfs GPIO interface lives
+#define DEFAULT_GPIO_ROOT "/sys/class/gpio"
+#define DEFAULT_TRACE_FILE "/tmp/pi-button-to-kbd.trace"
+
 // Set whether to write debug output
 #define DEBUG 0
 
-// Define the time discrepancy that we will interpret as a genuine 
-// clock change  (see above)
-#define CLOCK_ERROR_SECONDS SEC_PER_YEAR
-
-// This is the mapping table. Each GPIO pin is associated with an 
-//   array of key events. The event array ends with pin 0, since there is no
-//   GPIO pin zero. 
+// This is the built-in mapping table, which is used if no configuration
+//   file or mapping image is given on the command line. Each GPIO pin is 
+//   associated with an array of key events. The event array ends with 
+//   pin 0, since there is no GPIO pin zero. 
 //   The key codes are scan codes, define in input-event-codes.h.
-//   To indicate a key press, OR the scan code with DOWN. To indicate a key
-//   release, OR it with UP. Actually, UP is 0, but it's easier to read
-//   if both press and release are coded the same. 
-
-typedef struct _Mapping
-  {
-  int pin;
-  unsigned int *keys; 
-  } Mapping;
+//   To indicate a key press, use PRESS(code), and to indicate a key
+//   release, use RELEASE(code). PAUSE(msec) waits before the next step.
+//   The list of steps ends with END.
+//   The Step type is defined in defs.h, and Mapping in mapping.h
 
 // Here are the mappings for specific keys...
 // Space bar
-unsigned int key_space[] = {KEY_SPACE | DOWN, KEY_SPACE | UP, 0};
+Step key_space[] = {PRESS (KEY_SPACE), RELEASE (KEY_SPACE), END};
 
 // Ctrl+R
-unsigned int key_ctrl_r[] = {KEY_LEFTCTRL | DOWN, 
-               KEY_R | DOWN, KEY_R | UP, KEY_LEFTCTRL | UP, 0};
+Step key_ctrl_r[] = {PRESS (KEY_LEFTCTRL), 
+               PRESS (KEY_R), RELEASE (KEY_R), RELEASE (KEY_LEFTCTRL), END};
 
 // ...and here is the mapping from pins to keystrokes.
 Mapping mappings[] = 
@@ -110,6 +94,40 @@ Mapping mappings[] =
 
 static BOOL debug = DEBUG;
 
+// The mapping image in use -- see mapping.h
+static const MapImage *image = NULL;
+
+// The directory that the GPIO pins appear in. This can be changed, to
+//   run the program on a simulated tree -- see gpiosim_bench.c.
+static const char *gpio_root = DEFAULT_GPIO_ROOT;
+
+// In a simulated tree, each pin's 'value' is a FIFO, to which the 
+//   simulator writes each new state of the pin, as "0\n" or "1\n". 
+//   Then the state of the pin is the last one read, rather than what
+//   'value' says when it is read again.
+static BOOL pin_is_fifo[MAX_PINS];
+static int fifo_fds[MAX_PINS];
+static int fifo_state[MAX_PINS];
+
+// The debouncing state. Times are in milliseconds since the program 
+//   started, on the program's clock -- see clock.h.
+static uint64_t start_nsec = 0;
+static int bounce_time = BOUNCE_MSEC;
+static int edge = EDGE;
+static int ticks[MAX_PINS]; // Time of last button press
+static BOOL held[MAX_PINS]; // Nudge buttons that are being held down
+static int nheld = 0;
+static PinStats pin_stats[MAX_PINS]; // Indexed like the image's entries
+static LoopStats loop_stats;
+static int last_level[MAX_PINS]; // Level after the last accepted edge
+
+// The recording being replayed, if any, and how far we have got
+static EdgeRecord *replay_records = NULL;
+static long replay_nrecords = 0;
+static long replay_pos = 0;
+static int replay_level[MAX_PINS]; // Last level of each pin
+static long replay_next[MAX_PINS]; // Where to look for its next read
+
 // quit will be set true in the quit signal handler, ending the program's
 //   main loop
 static BOOL quit = FALSE;
@@ -118,7 +136,7 @@ static BOOL quit = FALSE;
   dbglog
   Write debug logging to stderr, if debug==TRUE
 ======================================================================*/
-static void dbglog (const char *fmt,...)
+void dbglog (const char *fmt,...)
   {
   if (!debug) return;
   va_list ap;
@@ -169,9 +187,11 @@ static void unexport_pins (int *pins, int npins)
   for (int i = 0; i < npins; i++)
     {
     int pin = pins[i];
-    char s[50];
-    snprintf (s, sizeof(s), "%d", pin);
-    write_to_file ("/sys/class/gpio/unexport", s);
+    char s[PATH_MAX];
+    snprintf (s, sizeof(s), "%s/unexport", gpio_root);
+    char num[20];
+    snprintf (num, sizeof(num), "%d", pin);
+    write_to_file (s, num);
     }
   }
 
@@ -189,12 +209,14 @@ static void export_pins (int *pins, int npins)
   for (i = 0; i < npins; i++)
     {
     int pin = pins[i];
-    char s[50];
-    snprintf (s, sizeof(s), "%d", pin);
-    write_to_file ("/sys/class/gpio/export", s);
-    snprintf (s, sizeof(s), "/sys/class/gpio/gpio%d/direction", pin);
+    char s[PATH_MAX];
+    snprintf (s, sizeof(s), "%s/export", gpio_root);
+    char num[20];
+    snprintf (num, sizeof(num), "%d", pin);
+    write_to_file (s, num);
+    snprintf (s, sizeof(s), "%s/gpio%d/direction", gpio_root, pin);
     write_to_file (s, "in");
-    snprintf (s, sizeof(s), "/sys/class/gpio/gpio%d/edge", pin);
+    snprintf (s, sizeof(s), "%s/gpio%d/edge", gpio_root, pin);
     write_to_file (s, "both");
     }
   }
@@ -210,9 +232,9 @@ static void export_pins (int *pins, int npins)
 ======================================================================*/
 int get_pin_state (int pin)
   {               
-  char s[50];
+  char s[PATH_MAX];
   char buff[3]; 
-  snprintf (s, sizeof(s), "/sys/class/gpio/gpio%d/value", pin);
+  snprintf (s, sizeof(s), "%s/gpio%d/value", gpio_root, pin);
   int fd = open (s, O_RDONLY);
   int rc = read (fd, buff, sizeof(buff));
   close (fd);
@@ -221,270 +243,782 @@ int get_pin_state (int pin)
   }
 
 /*======================================================================
-  open_uinput 
-  Open and prepare the uinput device. If any of this fails, exit the
-    program -- there is nothing useful to be done afterwards.
+  current_state 
+  Get the state of the i'th pin, which is 'pin'. For a simulated pin,
+    this is the last state in its FIFO, which might have changed since
+    the main loop read it.
 ======================================================================*/
-static int open_uinput (void)
+static int current_state (int i, int pin)
   {
-  int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-  if (fd > 0)
-    {
-    ioctl (fd, UI_SET_EVBIT, EV_KEY);
-    // We need to export all the key codes in the mapping table.
-    // It doesn't hurt to export some more than once
-    int p = 0;
-    Mapping *m = &mappings[p]; 
-    while (m->pin != 0) 
-      {
-      unsigned int *keystrokes = m->keys;
-      while (*keystrokes)
-        {
-	unsigned char raw_keystroke = *keystrokes & 0xFF;
-        ioctl (fd, UI_SET_KEYBIT, raw_keystroke);
-        keystrokes++;
-        }
-      p++;
-      m = &mappings[p];
-      }; 
-
-    // Create the dummy input device
-    // This will create a new /dev/input/eventXX device, that will
-    //   feed into the kernel's input subsystem
-    struct uinput_setup usetup;
-    memset (&usetup, 0, sizeof(usetup));
-    usetup.id.bustype = BUS_USB;
-    usetup.id.vendor = 0x1234; // Dummy
-    usetup.id.product = 0x5678; // Dummy
-    strcpy (usetup.name, "Dummy input device");
-    ioctl (fd, UI_DEV_SETUP, &usetup);
-    ioctl (fd, UI_DEV_CREATE);
-
-    return fd;
-    } 
-  else
-    {
-    fprintf (stderr, "Can't open /dev/uinput: %s\n", strerror (errno));
-    exit (-1);
-    return -1; 
-    }
+  if (!pin_is_fifo[i]) return get_pin_state (pin);
+  char buff[64];
+  int n;
+  while ((n = read (fifo_fds[i], buff, sizeof (buff))) >= 2)
+    fifo_state[i] = buff[n - 2] - '0';
+  return fifo_state[i];
   }
 
 /*======================================================================
-  close_uinput 
+  button_pressed 
+  Called by the main loop whenever a GPIO state change is detected.
+  The main loop monitors the pins in the same order as the entries
+    in the mapping image, so it can pass the entry directly, without
+    any lookup. We pass the entry to the output thread, which plays
+    its macro, straight away if there is nothing else playing. 
+    'edge_time' is when the main loop woke up for the GPIO event, on
+    the monotonic clock, and ends up as the timestamp of the output
+    events.
 ======================================================================*/
-static void close_uinput (int fd)
+static void button_pressed (const MapEntry *entry, int state, 
+    uint64_t edge_time)
   {
-  // Easy -- nothing else to do in this current implementation
-  close (fd);
+  USDT3 (press, entry->pin, state, edge_time);
+  output_submit (entry, TRUE, edge_time);
   }
 
 /*======================================================================
-  get_mapping 
-  Get the entry in the mapping table that corresponds to a specific
-    GPIO pin. Returns NULL if the pin has no entry in the mapping
-    table, but that should never happen unless there is a really
-    weird internal error. 
+  button_released 
+  Called by the main loop when a button that nudges the pointer is
+    released, which stops the pointer moving. Other buttons only act
+    when they are pressed, so their releases are not reported.
 ======================================================================*/
-const Mapping *get_mapping (int pin)
+static void button_released (const MapEntry *entry, uint64_t edge_time)
   {
-  Mapping *ret = NULL;
-  int p = 0;
-  Mapping *m = &mappings[p]; 
-  while (m->pin != 0) 
-    {
-    if (pin == m->pin) return m;
-    p++;
-    m = &mappings[p];
-    }; 
-
-  return ret;
+  USDT2 (release, entry->pin, edge_time);
+  output_submit (entry, FALSE, edge_time);
   }
 
+/*======================================================================
+  replay_state 
+  Get the level of the i'th pin at time 'at' from the recording being
+    replayed. Each time the pin was read, a record was made straight 
+    after the one being replayed, or the one for the edge that woke up
+    the main loop, so the reads are replayed in the same order. A 
+    recording that has no reads, such as one made up for testing, 
+    gives the level of the pin at the time instead.
+======================================================================*/
+static int replay_state (int i, uint64_t at)
+  {
+  int pin = mapimage_entry (image, i)->pin;
+  long k;
+  for (k = replay_pos; k < replay_nrecords; k++)
+    {
+    const EdgeRecord *r = &replay_records[k];
+    if (!(r->flags & RECORD_SETTLED))
+      {
+      if (k == replay_pos) continue;
+      break;
+      }
+    if (r->pin != pin || k < replay_next[i]) continue;
+    replay_next[i] = k + 1;
+    return (r->flags & RECORD_FAILED) ? -1 : (r->flags & RECORD_LEVEL);
+    }
+  int level = replay_level[i];
+  for (k = replay_pos + 1; k < replay_nrecords 
+       && replay_records[k].nsec <= at; k++)
+    {
+    if (replay_records[k].pin == pin && 
+         !(replay_records[k].flags & RECORD_FAILED))
+      level = replay_records[k].flags & RECORD_LEVEL;
+    }
+  return level;
+  }
 
 /*======================================================================
-  emit_event
-  Use uinput to send an event with a specific type, code, and value
+  read_state 
+  Read the state of the i'th pin at time 'now', and record it, if we
+    are recording. When replaying, the state comes from the recording.
 ======================================================================*/
-void emit_event (int uinput_fd, int type, int code, int val)
+static int read_state (int i, uint64_t now)
   {
-  struct input_event ie;
-  ie.type = type;
-  ie.code = code;
-  ie.value = val;
-  // I don't think it matters, in practice, whether we set the 
-  //   keystroke timestamp. 
-  ie.time.tv_sec = 0;
-  ie.time.tv_usec = 0;
-  write (uinput_fd, &ie, sizeof(ie));
+  int state;
+  if (replay_records) 
+    state = replay_state (i, now);
+  else
+    {
+    int pin = mapimage_entry (image, i)->pin;
+    state = current_state (i, pin);
+    record_edge (now, pin, state, RECORD_SETTLED);
+    }
+  if (state < 0) counter_add (&pin_stats[i].read_errors, 1);
+  return state;
   }
 
 /*======================================================================
-  emit_keystroke  
-  Send a keystroke event, using the 'key' entry from the mapping
-    table. The event may be a key up or key down; the MASK 
-    bitmap is used to distinguish the two.
+  count_edge 
+  Count an edge on the i'th pin that got past the bounce lock-out, by
+    the level the pin had settled to, and trace the decision
 ======================================================================*/
-static void emit_keystroke (int uinput_fd, unsigned int key) 
+static void count_edge (int i, int state, uint64_t now)
   {
-  if (key & DOWN)
+  int pin = mapimage_entry (image, i)->pin;
+  if ((state == 0 && (edge & EDGE_FALLING))
+       || (state == 1 && (edge & EDGE_RISING)))
+    {
+    counter_add (&pin_stats[i].presses, 1);
+    trace (TRACE_MAIN, now, TRACE_PRESS, 0, pin, state);
+    USDT3 (accept, pin, state, now);
+    }
+  else if (state < 0 || state == last_level[i])
     {
-    emit_event (uinput_fd, EV_KEY, key & 0xFF, 1);
-    emit_event (uinput_fd, EV_SYN, SYN_REPORT, 0);
+    counter_add (&pin_stats[i].rejected, 1);
+    trace (TRACE_MAIN, now, TRACE_REJECT, 0, pin, state);
+    USDT3 (reject, pin, state, now);
     }
   else
     {
-    emit_event (uinput_fd, EV_KEY, key & 0xFF, 0);
-    emit_event (uinput_fd, EV_SYN, SYN_REPORT, 0);
+    counter_add (&pin_stats[i].releases, 1);
+    trace (TRACE_MAIN, now, TRACE_RELEASE, 0, pin, state);
+    USDT3 (accept, pin, state, now);
     }
+  if (state >= 0) last_level[i] = state;
   }
 
 /*======================================================================
-  button_pressed 
-  Called by the main loop whenever a GPIO state change is detected.
-  We find the keyboard mapping that corresponds to the detected
-    pin, and output the keystrokes from that mapping.
+  handle_edge 
+  Debounce an edge on the i'th pin, which the main loop woke up for at
+    time 'now', and act on it if it is a real press or release
 ======================================================================*/
-static void button_pressed (int uinput_fd, int pin, int state)
+static void handle_edge (int i, uint64_t now)
   {
-  const Mapping *m = get_mapping (pin);
-  if (m)
+  int total_msec = (now - start_nsec) / 1000000;
+  counter_add (&pin_stats[i].edges, 1);
+  // The test for total > 1000 is to prevent spurious events
+  //   when the program first starts up
+  if (total_msec - ticks[i] <= bounce_time || total_msec <= 1000) 
     {
-    unsigned int *keystrokes = m->keys;
-    while (*keystrokes)
+    counter_add (&pin_stats[i].bounces, 1);
+    int pin = mapimage_entry (image, i)->pin;
+    trace (TRACE_MAIN, now, TRACE_BOUNCE, 0, pin, 0);
+    USDT2 (bounce, pin, now);
+    return;
+    }
+
+  // We need a small delay here. Even though the last interrupt
+  //   received should have been for the desired edge, in practice
+  //   it seems that we need to wait a little while for the 
+  //   sysfs state to settle. I am not sure whether the figure
+  //   I have chosen is universally applicable, or whether it
+  //   needs to be tweaked. When replaying, the recording says what 
+  //   the state was after the delay. A signal, such as SIGUSR1 for the
+  //   trace, can cut the sleep short, so it is finished afterwards.
+  uint64_t settle = clock_now() + SETTLE_MSEC * 1000000ULL;
+  while (clock_now() < settle && !quit) clock_sleep_until (settle);
+  uint64_t settled = clock_now();
+  int state = read_state (i, settled);
+  const MapEntry *entry = mapimage_entry (image, i);
+  if ((state == 0 && (edge & EDGE_FALLING))
+       || (state == 1 && (edge & EDGE_RISING)))
+    {
+    dbglog ("GPIO state change: pin %d, state %d\n", entry->pin, state);
+    button_pressed (entry, state, now);
+    if (mapentry_has_nudge (entry) && !held[i])
       {
-      dbglog ("Emit keystroke %04X\n", *keystrokes);
-      emit_keystroke (uinput_fd, *keystrokes);
-      keystrokes++;
+      held[i] = TRUE;
+      nheld++;
       }
     }
-  else
+  else if (held[i])
     {
-    fprintf (stderr, "Inernal error: pin %d with no mapping\n", pin);
+    dbglog ("GPIO release: pin %d, state %d\n", entry->pin, state);
+    button_released (entry, now);
+    held[i] = FALSE;
+    nheld--;
     }
+  count_edge (i, state, settled);
+  ticks[i] = total_msec;
   }
 
 /*======================================================================
-  main
+  check_held 
+  A nudge button released during the bounce lock-out would keep the
+    pointer moving for ever, so check the held ones again, at time
+    'now', once their lock-out has expired
 ======================================================================*/
-int main (int argc, char **argv)
+static void check_held (uint64_t now)
   {
-  dbglog ("%s version " VERSION "starting\n", argv[0]);
-  int pins[MAX_PINS];
-  int npins = 0;
-  int edge = EDGE;
+  int total_msec = (now - start_nsec) / 1000000;
+  for (int i = 0; i < image->nentries && nheld; i++)
+    {
+    if (!held[i] || total_msec - ticks[i] <= bounce_time) continue;
+    int state = read_state (i, now);
+    if ((state == 0 && (edge & EDGE_FALLING))
+         || (state == 1 && (edge & EDGE_RISING)))
+      continue;
+    const MapEntry *entry = mapimage_entry (image, i);
+    dbglog ("GPIO release after lock-out: pin %d\n", entry->pin);
+    button_released (entry, clock_now());
+    count_edge (i, state, now);
+    held[i] = FALSE;
+    nheld--;
+    }
+  }
+
+/*======================================================================
+  mono_msec 
+  Get the monotonic clock time in milliseconds, for timing the startup
+======================================================================*/
+static double mono_msec (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+  }
 
-  int pin = 0;
-  Mapping *m = &mappings[pin]; 
-  while (m->pin != 0) 
+/*======================================================================
+  load_mappings 
+  Get the mapping image from wherever the command line says it should
+    come from. If we have both a config file and an image file, the
+    image file is a cache: we use it if it is valid and was built from
+    the config file as it is now; otherwise we parse the config file
+    and write a new image for next time. 'how' is set to a description
+    of where the mappings actually came from.
+======================================================================*/
+static const MapImage *load_mappings (const char *config, 
+    const char *image_file, const char **how)
+  {
+#ifdef FIXED_MAPPINGS
+  if (config || image_file)
+    fprintf (stderr, "This version has its mappings built in: "
+      "ignoring --config and --image\n");
+  *how = "built in at compile time";
+  return fixed_image ();
+#endif
+  if (image_file)
     {
-    pins[npins++] = m->pin;
-    pin++;
-    m = &mappings[pin];
-    }; 
+    const MapImage *mapped = mapimage_map (image_file);
+    if (mapped && (!config || mapimage_is_current (mapped, config)))
+      {
+      *how = "mapped image";
+      return mapped;
+      }
+    if (mapped) mapimage_release (mapped);
+    if (!config)
+      {
+      fprintf (stderr, "Can't use mapping image %s\n", image_file);
+      exit (-1);
+      }
+    // The image is only a cache, so carry on without it if it can't be
+    //   written, on a read-only filesystem for example
+    MapImage *built = mapimage_from_config (config);
+    if (mapimage_write (built, image_file))
+      *how = "config file (image rebuilt)";
+    else
+      *how = "config file (image not written)";
+    return built;
+    }
+  if (config)
+    {
+    *how = "config file";
+    return mapimage_from_config (config);
+    }
+  *how = "built-in table";
+  return mapimage_from_table (mappings);
+  }
 
-  dbglog ("Exporting pins\n");
-  export_pins (pins, npins);
+/*======================================================================
+  find_pin 
+  Find the entry for a pin. When the mappings are compiled in, this
+    is a switch statement, generated from the config file
+======================================================================*/
+static inline const MapEntry *find_pin (int pin)
+  {
+#ifdef FIXED_MAPPINGS
+  return fixed_find_pin (pin);
+#else
+  return mapimage_find_pin (image, pin);
+#endif
+  }
 
-  // Enable the quit signal handler as soon as anything has been done on
-  //   the GPIO: we don't want to leave the GPIO in an odd state
-  signal (SIGQUIT, quit_signal);
-  signal (SIGTERM, quit_signal);
-  signal (SIGHUP, quit_signal);
-  signal (SIGINT, quit_signal);
+/*======================================================================
+  run_benchmark 
+  Time the dispatch path -- finding the entry for a pin, queueing its
+    macro, and writing its events -- without using the GPIO or uinput,
+    so that the effect of building with the mappings compiled in can
+    be measured. The events are encoded as the sink would, and written
+    to /dev/null, and the macros' pauses are skipped.
+======================================================================*/
+static void run_benchmark (const Sink *sink, const int *pins, int npins, 
+    long n)
+  {
+  int fds[MAX_DEVICES];
+  int fd = open ("/dev/null", O_WRONLY);
+  for (int i = 0; i < MAX_DEVICES; i++) fds[i] = fd;
+  output_init (sink, fds, image);
+
+  const MapEntry * volatile entry = NULL;
+  uint64_t t0 = mono_nsec();
+  for (long i = 0; i < n; i++)
+    entry = find_pin (pins[i % npins]);
+  uint64_t t1 = mono_nsec();
+  uint64_t now = 0;
+  for (long i = 0; i < n; i++)
+    {
+    entry = find_pin (pins[i % npins]);
+    output_start_macro (entry, 0, 0);
+    int64_t wait;
+    while ((wait = output_run (now)) >= 0) now += wait;
+    }
+  uint64_t t2 = mono_nsec();
+  close (fd);
 
-  dbglog ("Opening uinput device\n");
-  int uinput_fd = open_uinput(); // Don't need to check return
+  printf ("%ld dispatches: lookup %.1f ns, lookup and output %.1f ns\n",
+    n, (double)(t1 - t0) / n, (double)(t2 - t1) / n);
+  }
 
+/*======================================================================
+  run_gpio 
+  Watch the GPIO pins, and act on their edges, until a quit signal is
+    caught. Every level read from a pin is recorded, if 'record' names
+    a file to record to.
+======================================================================*/
+static void run_gpio (const int *pins, int npins, const char *record)
+  {
   struct pollfd fdset[MAX_PINS];
   struct pollfd fdset_base[MAX_PINS];
+  memset (fdset_base, 0, sizeof (fdset_base));
 
   // Set up poll FD array for each pin's 'value' pseudo-file
   for (int i = 0; i < npins; i++)
     {
     int pin = pins[i];
-    char s[50]; // should be large enough
-    snprintf (s, sizeof(s), "/sys/class/gpio/gpio%d/value", pin);
-    int gpio_fd = open (s, O_RDONLY|O_NONBLOCK);
+    char s[PATH_MAX];
+    snprintf (s, sizeof(s), "%s/gpio%d/value", gpio_root, pin);
+    // A simulated pin's FIFO is opened for writing as well, so that it
+    //   never reports a hang-up if the simulator goes away
+    struct stat sb;
+    pin_is_fifo[i] = stat (s, &sb) == 0 && S_ISFIFO (sb.st_mode);
+    fifo_state[i] = -1;
+    int gpio_fd = open (s, (pin_is_fifo[i] ? O_RDWR : O_RDONLY)|O_NONBLOCK);
     if (gpio_fd < 0)
       {
       fprintf (stderr, "Can't open GPIO device %s\n", s);
       exit(-1);
       }
     fdset_base[i].fd = gpio_fd;
-    fdset_base[i].events = POLLPRI;
+    fifo_fds[i] = gpio_fd;
+    fdset_base[i].events = pin_is_fifo[i] ? POLLIN : POLLPRI;
     }
 
-  time_t start = time(NULL);
-  // The type of edge we will detect. Since all switches are rather bouncy,
-  //   'both' is probably safest. The debounce mechanism will prevent
-  int bounce_time = BOUNCE_MSEC;
-  int ticks[MAX_PINS]; // Time of last button press
-  memset (ticks, 0, sizeof (int) * MAX_PINS);
+  if (record) record_open (record, start_nsec);
 
   dbglog ("Starting poll\n");
   while (!quit)
     {
     memcpy (&fdset, &fdset_base, sizeof (fdset));
-    poll (fdset, npins, 3000);
+    // While a nudge button is held, wake up after the bounce lock-out
+    //   to check that it hasn't been released during it
+    // A signal, such as SIGUSR1 for the trace, interrupts the poll, and 
+    //   then the revents can't be trusted
+    if (clock_poll (fdset, npins, 
+         clock_now() + (nheld ? bounce_time : 3000) * 1000000ULL) < 0)
+      continue;
+    counter_add (&loop_stats.wakeups, 1);
+    // sysfs doesn't tell us when the edge happened, so the best we
+    //   can do is note the time as soon as we wake up
+    uint64_t edge_time = clock_now();
 
     for (int i = 0; i < npins; i++)
       {
-      if (fdset[i].revents & POLLPRI)
+      if (fdset[i].revents & (POLLPRI | POLLIN))
         {
-        // For each pin, check for interrupt events
-        int pin = pins[i];
+        // For each pin, check for interrupt events. Reading the value
+        //   acknowledges the interrupt, and gives the level, which is 
+        //   recorded if we are recording.
         char buff[50];
-        // In practice, I've never seen more than two bytes
-        //   delivered per interrupt, however many
-        //   switch bounces there are
-        read (fdset[i].fd, buff, sizeof(buff));
-
-        // If the discrepancy between start and now is too
-        //   great, assume that the clock has been fiddled
-        //   with
-        // If you have a real-time-clock, this test can probably
-        //   be removed
-        if (abs (time (NULL) - start) > CLOCK_ERROR_SECONDS)
+        int level = -1;
+        if (pin_is_fifo[i])
           {
-          dbglog ("System time has changed: correcting\n");
-          start = time (NULL);
+          int n = read (fdset[i].fd, buff, sizeof(buff));
+          if (n >= 2) level = fifo_state[i] = buff[n - 2] - '0';
           }
-        else
+        else if (pread (fdset[i].fd, buff, sizeof(buff), 0) >= 1)
+          level = buff[0] - '0';
+        if (level < 0) counter_add (&pin_stats[i].read_errors, 1);
+        record_edge (edge_time, pins[i], level, 0);
+        trace (TRACE_MAIN, edge_time, TRACE_EDGE, 0, pins[i], level);
+        USDT3 (edge, pins[i], level, edge_time);
+        handle_edge (i, edge_time);
+        }
+      }
+    check_held (clock_now());
+    }
+  record_close();
+  }
+
+/*======================================================================
+  run_replay 
+  Feed the recording that has been loaded through the debouncing and 
+    output, rather than reading the GPIO. The clock has been set to the
+    recording's times: normally it is virtual, so this goes as fast as
+    possible, but with --realtime it is real, and the edges are spaced 
+    out as they were when they were recorded. Edges on pins that
+    aren't in the mappings are ignored.
+======================================================================*/
+static void run_replay (void)
+  {
+  struct rusage ru0, ru1;
+  getrusage (RUSAGE_SELF, &ru0);
+  uint64_t real_start = mono_nsec();
+  for (int i = 0; i < MAX_PINS; i++) 
+    {
+    replay_level[i] = -1;
+    replay_next[i] = 0;
+    }
+  long nedges = 0;
+  for (replay_pos = 0; replay_pos < replay_nrecords && !quit; replay_pos++)
+    {
+    const EdgeRecord *r = &replay_records[replay_pos];
+    int i;
+    for (i = 0; i < image->nentries; i++)
+      if (mapimage_entry (image, i)->pin == r->pin) break;
+    if (i == image->nentries) continue;
+    if (!(r->flags & RECORD_FAILED)) 
+      replay_level[i] = r->flags & RECORD_LEVEL;
+    else if (!(r->flags & RECORD_SETTLED))
+      counter_add (&pin_stats[i].read_errors, 1);
+    clock_sleep_until (r->nsec);
+    if (r->flags & RECORD_SETTLED)
+      {
+      // A read that hasn't been replayed already is one that was made
+      //   when the bounce lock-out of a held button expired
+      if (replay_pos >= replay_next[i]) check_held (r->nsec);
+      continue;
+      }
+    int level = r->flags & RECORD_FAILED ? -1 : r->flags & RECORD_LEVEL;
+    trace (TRACE_MAIN, r->nsec, TRACE_EDGE, 0, r->pin, level);
+    USDT3 (edge, r->pin, level, r->nsec);
+    counter_add (&loop_stats.wakeups, 1);
+    handle_edge (i, r->nsec);
+    nedges++;
+    }
+  // Let the output thread finish what it has been given
+  while (!output_idle() && !quit) 
+    clock_sleep_until (clock_now() + 1000000);
+  getrusage (RUSAGE_SELF, &ru1);
+  double cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec
+    + ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) * 1e6
+    + (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec
+    + ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec);
+  fprintf (stderr, "Replayed %ld edges (%ld records), %.3f s of "
+    "recording in %.3f s, %.3f us CPU per edge, %llu presses\n", 
+    nedges, replay_nrecords, (clock_now() - start_nsec) / 1e9,
+    (mono_nsec() - real_start) / 1e9, nedges ? cpu / nedges : 0.0,
+    (unsigned long long)counter_get (&output_get_ring_stats()->submitted));
+  free (replay_records);
+  replay_records = NULL;
+  }
+
+/*======================================================================
+  show_usage 
+======================================================================*/
+static void show_usage (const char *argv0)
+  {
+  printf ("Usage: %s [options]\n", argv0);
+  printf ("  -B, --benchmark=N   time N dispatches without GPIO or uinput,"
+    " and exit\n");
+  printf ("  -c, --config=FILE   read mappings from a configuration file\n");
+  printf ("  -C, --compile       compile the configuration file into the\n");
+  printf ("                        mapping image, and exit\n");
+  printf ("  -G, --gpio-root=DIR where the GPIO pins are (default "
+    DEFAULT_GPIO_ROOT ")\n");
+  printf ("  -g, --generate=FILE write the mappings as C source, for\n");
+  printf ("                        building with FIXED_MAPPINGS, and exit\n");
+  printf ("  -h, --help          show this message\n");
+  printf ("  -L, --latency       read back the events from uinput, and\n");
+  printf ("                        report the latency of presses on exit\n");
+  printf ("  -m, --image=FILE    use a precompiled mapping image\n");
+  printf ("  -M, --metrics=FILE  write metrics for Prometheus to FILE\n");
+  printf ("  -I, --metrics-interval=SEC\n");
+  printf ("                      how often to write them (default %d)\n",
+    METRICS_DEFAULT_INTERVAL);
+  printf ("  -P, --replay=FILE   feed recorded edges through the program,\n");
+  printf ("                        instead of watching the GPIO\n");
+  printf ("  -R, --record=FILE   record every level read from the GPIO\n");
+  printf ("  -T, --realtime      replay at the recorded speed, rather than\n");
+  printf ("                        as fast as possible\n");
+  printf ("  -s, --sink=SINK     where to send events: uinput (default),\n");
+  printf ("                        text:DEVICE[,LAYOUT], text:pty,\n");
+  printf ("                        socket:PATH, or json\n");
+  printf ("  -o, --overflow=HOW  what to do with presses when the output\n");
+  printf ("                        is behind: block (default), drop-oldest,\n");
+  printf ("                        or coalesce\n");
+  printf ("  -S, --stats=PATH    serve live statistics on a Unix socket\n");
+  printf ("  -t, --trace-file=FILE where SIGUSR1 writes the trace (default\n");
+  printf ("                        " DEFAULT_TRACE_FILE ")\n");
+  printf ("  -D, --decode-trace=FILE print a trace file as text, and exit\n");
+  printf ("  -v, --verbose       report startup time, and latency on exit\n");
+  printf ("      --version       show version\n");
+  }
+
+/*======================================================================
+  main
+======================================================================*/
+int main (int argc, char **argv)
+  {
+  double t_start = mono_msec();
+  const char *config = NULL;
+  const char *image_file = NULL;
+  BOOL compile = FALSE;
+  const char *generate = NULL;
+  long benchmark = 0;
+  BOOL verbose = FALSE;
+  BOOL latency = FALSE;
+  const char *record = NULL;
+  const char *stats_path = NULL;
+  const char *metrics_path = NULL;
+  int metrics_interval = METRICS_DEFAULT_INTERVAL;
+  const char *trace_file = DEFAULT_TRACE_FILE;
+  const char *replay = NULL;
+  BOOL realtime = FALSE;
+  const Sink *sink = NULL;
+  const char *sink_arg = NULL;
+
+  static struct option long_options[] =
+    {
+      {"benchmark", required_argument, NULL, 'B'},
+      {"config", required_argument, NULL, 'c'},
+      {"decode-trace", required_argument, NULL, 'D'},
+      {"compile", no_argument, NULL, 'C'},
+      {"generate", required_argument, NULL, 'g'},
+      {"gpio-root", required_argument, NULL, 'G'},
+      {"help", no_argument, NULL, 'h'},
+      {"image", required_argument, NULL, 'm'},
+      {"latency", no_argument, NULL, 'L'},
+      {"metrics", required_argument, NULL, 'M'},
+      {"metrics-interval", required_argument, NULL, 'I'},
+      {"overflow", required_argument, NULL, 'o'},
+      {"realtime", no_argument, NULL, 'T'},
+      {"record", required_argument, NULL, 'R'},
+      {"replay", required_argument, NULL, 'P'},
+      {"sink", required_argument, NULL, 's'},
+      {"stats", required_argument, NULL, 'S'},
+      {"trace-file", required_argument, NULL, 't'},
+      {"verbose", no_argument, NULL, 'v'},
+      {"version", no_argument, NULL, 'V'},
+      {0, 0, 0, 0}
+    };
+
+  int opt;
+  while ((opt = getopt_long (argc, argv, "B:c:CD:g:G:hI:Lm:M:o:P:R:s:S:t:Tv", long_options, NULL)) 
+      != -1)
+    {
+    switch (opt)
+      {
+      case 'B': benchmark = atol (optarg); break;
+      case 'c': config = optarg; break;
+      case 'C': compile = TRUE; break;
+      case 'D': trace_decode (optarg, stdout); exit (0);
+      case 'g': generate = optarg; break;
+      case 'G': gpio_root = optarg; break;
+      case 'h': show_usage (argv[0]); exit (0);
+      case 'L': latency = TRUE; break;
+      case 'I': metrics_interval = atoi (optarg); break;
+      case 'm': image_file = optarg; break;
+      case 'M': metrics_path = optarg; break;
+      case 'o': 
+        {
+        int policy = output_overflow_from_name (optarg);
+        if (policy < 0)
           {
-          struct timeval tv;
-          gettimeofday (&tv, NULL);
-          int msec = tv.tv_usec / 1000;
-          int total_msec = (tv.tv_sec  - start) * 1000.0 + msec;
-          //printf ("tick %d %d %d\n", pins[i], total_msec, state);
-          // The test for total > 1000 is to prevent spurious events
-          //   when the program first starts up
-          if (total_msec - ticks[i] > bounce_time && total_msec > 1000)
-            {
-            // We need a small delay here. Even though the last interrupt
-            //   received should have been for the desired edge, in practice
-            //   it seems that we need to wait a little while for the 
-            //   sysfs state to settle. I am not sure whether the figure
-            //   I have chosen is universally applicable, or whether it
-            //   needs to be tweaked.
-            usleep (2000);
-            int state = get_pin_state (pin);
-            if ((state == 0 && (edge & EDGE_FALLING))
-                 || (state == 1 && (edge & EDGE_RISING)))
-              {
-              dbglog ("GPIO state change: pin %d, state %d\n", pin, state);
-              button_pressed (uinput_fd, pin, state);
-              }
-            ticks[i] = total_msec;
-            }
+          fprintf (stderr, "%s: unknown overflow policy '%s'\n", 
+            argv[0], optarg);
+          exit (-1);
           }
+        output_set_overflow (policy);
+        break;
         }
+      case 'P': replay = optarg; break;
+      case 'R': record = optarg; break;
+      case 'T': realtime = TRUE; break;
+      case 's':
+        sink = sink_find (optarg, &sink_arg);
+        if (!sink)
+          {
+          fprintf (stderr, "%s: unknown sink '%s'\n", argv[0], optarg);
+          exit (-1);
+          }
+        break;
+      case 'S': stats_path = optarg; break;
+      case 't': trace_file = optarg; break;
+      case 'v': verbose = TRUE; break;
+      case 'V': printf ("%s version " VERSION "\n", argv[0]); exit (0);
+      default: show_usage (argv[0]); exit (-1);
       }
     }
+
+  dbglog ("%s version " VERSION " starting\n", argv[0]);
+  if (!sink) sink = sink_find ("uinput", &sink_arg);
+  if (latency && strcmp (sink->name, "uinput") != 0)
+    {
+    fprintf (stderr, "%s: --latency only works with the uinput sink\n", 
+      argv[0]);
+    exit (-1);
+    }
+  // The probe compares the times of events with the kernel's
+  if (latency && replay)
+    {
+    fprintf (stderr, "%s: --latency can't be used with --replay\n", 
+      argv[0]);
+    exit (-1);
+    }
+
+  if (compile)
+    {
+    if (!config || !image_file)
+      {
+      fprintf (stderr, "%s: --compile needs --config and --image\n", 
+        argv[0]);
+      exit (-1);
+      }
+    MapImage *built = mapimage_from_config (config);
+    BOOL ok = mapimage_write (built, image_file);
+    mapimage_release (built);
+    exit (ok ? 0 : -1);
+    }
+
+  const char *how;
+  image = load_mappings (config, image_file, &how);
+  double t_loaded = mono_msec();
+
+  if (generate)
+    {
+    mapimage_write_c (image, generate, config ? config : "built-in table");
+    exit (0);
+    }
+
+  int pins[MAX_PINS];
+  int npins = 0;
+
+  for (int i = 0; i < image->nentries; i++)
+    pins[npins++] = mapimage_entry (image, i)->pin;
+
+  if (benchmark > 0)
+    {
+    printf ("Mappings loaded in %.3f ms (%s)\n", t_loaded - t_start, how);
+    run_benchmark (sink, pins, npins, benchmark);
+    exit (0);
+    }
+
+  if (!replay)
+    {
+    dbglog ("Exporting pins\n");
+    export_pins (pins, npins);
+    }
+
+  // Enable the quit signal handler as soon as anything has been done on
+  //   the GPIO: we don't want to leave the GPIO in an odd state
+  signal (SIGQUIT, quit_signal);
+  signal (SIGTERM, quit_signal);
+  signal (SIGHUP, quit_signal);
+  signal (SIGINT, quit_signal);
+
+  // A replay runs on the recording's times, on a virtual clock unless
+  //   it is in real time. The output thread follows the virtual clock,
+  //   so it has to be set up first.
+  if (replay)
+    {
+    replay_records = record_load (replay, &start_nsec, &replay_nrecords);
+    if (realtime)
+      clock_use_real (start_nsec);
+    else
+      clock_use_virtual (start_nsec, output_settled);
+    }
+
+  double t_exported = mono_msec();
+  dbglog ("Opening %s sink\n", sink->name);
+  int device_fds[MAX_DEVICES];
+  sink->open (sink_arg, image, device_fds); // Don't need to check return
+  if (latency)
+    {
+    probe_open (device_fds, image);
+    output_set_probe (TRUE);
+    }
+  output_start_thread (sink, device_fds, image);
+  for (int i = 0; i < MAX_PINS; i++) last_level[i] = -1;
+  if (stats_path) stats_start (stats_path, image, pin_stats, &loop_stats);
+  if (metrics_path) 
+    metrics_start (metrics_path, metrics_interval, image, pin_stats, 
+      &loop_stats);
+  double t_uinput = mono_msec();
+
+  if (!replay) start_nsec = clock_now();
+  trace_set_file (trace_file, start_nsec);
+  signal (SIGUSR1, trace_dump_signal);
+  if (verbose)
+    {
+    double t_ready = mono_msec();
+    fprintf (stderr, "Ready in %.3f ms: mappings %.3f ms (%s), "
+      "GPIO %.3f ms, %s %.3f ms\n", t_ready - t_start, 
+      t_loaded - t_start, how, t_exported - t_loaded, sink->name,
+      t_uinput - t_exported);
+    }
+
+  if (replay)
+    run_replay();
+  else
+    run_gpio (pins, npins, record);
+
   // We only get here if a quit signal has been caught
   dbglog ("Cleaning up\n");
-  unexport_pins (pins, npins);
-  close_uinput (uinput_fd);
+  stats_stop();
+  output_stop_thread();
+  metrics_stop();
+  if (verbose)
+    {
+    const OutputStats *stats = output_get_stats();
+    const RingStats *ring = output_get_ring_stats();
+    unsigned long long edges = 0, bounces = 0, rejected = 0;
+    for (int i = 0; i < image->nentries; i++)
+      {
+      edges += counter_get (&pin_stats[i].edges);
+      bounces += counter_get (&pin_stats[i].bounces);
+      rejected += counter_get (&pin_stats[i].rejected);
+      }
+    fprintf (stderr, "Edges: %llu seen, %llu in the bounce lock-out, "
+      "%llu settled back and rejected\n", edges, bounces, rejected);
+    fprintf (stderr, "%llu presses passed to output thread, %llu dropped, "
+      "at most %llu waiting\n", 
+      (unsigned long long)counter_get (&ring->submitted),
+      (unsigned long long)counter_get (&ring->full), 
+      (unsigned long long)counter_get (&ring->high_water));
+    const Histogram *stages[] = {&ring->accept, &stats->accept_to_emit,
+      &stats->emit_duration, &stats->latency};
+    const char *names[] = {"edge to accept", "accept to emit", 
+      "emit duration", "edge to output"};
+    Histogram *copy = malloc (sizeof (Histogram));
+    hist_snapshot (&stats->latency, copy);
+    if (copy->count)
+      fprintf (stderr, "%llu presses: edge to output %.3f ms average, "
+        "%.3f ms maximum\n", (unsigned long long)copy->count, 
+        copy->total / 1e6 / copy->count, copy->max / 1e6);
+    for (int s = 0; s < 4 && copy->count; s++)
+      {
+      hist_snapshot (stages[s], copy);
+      fprintf (stderr, "  %-16s p50 %.3f p99 %.3f p99.9 %.3f max %.3f ms\n",
+        names[s], hist_percentile (copy, 500) / 1e6, 
+        hist_percentile (copy, 990) / 1e6, 
+        hist_percentile (copy, 999) / 1e6, copy->max / 1e6);
+      }
+    free (copy);
+    fprintf (stderr, "Output backlog: device busy %llu times, %llu presses "
+      "waited, %llu dropped, %llu coalesced, %llu cancelled\n", 
+      (unsigned long long)counter_get (&stats->device_busy), 
+      (unsigned long long)counter_get (&stats->blocked), 
+      (unsigned long long)counter_get (&stats->dropped), 
+      (unsigned long long)counter_get (&stats->coalesced),
+      (unsigned long long)counter_get (&stats->cancelled));
+    }
+  if (latency)
+    {
+    probe_report (stderr);
+    probe_close();
+    }
+  if (!replay) unexport_pins (pins, npins);
+  sink->close (device_fds, image->ndevices);
+#ifndef FIXED_MAPPINGS
+  mapimage_release (image);
+#endif
   }
 
 
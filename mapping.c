@@ -0,0 +1,1493 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  mapping.c
+
+  Functions for building the mapping image, either from the built-in
+    table or from a text configuration file, and for writing it to
+    disk and mapping it back into memory.
+
+  The configuration file has one line per GPIO pin. The first item
+    on the line is the pin number, and the rest are keystrokes,
+    separated by whitespace. A keystroke is a key name from
+    input-event-codes.h (the KEY_ prefix is optional), followed by
+    '+' for a key press, or '-' for a key release. A key name on its
+    own means a press followed by a release. So Ctrl+R is:
+
+    21 LEFTCTRL+ R LEFTCTRL-
+
+  A mapping can also be a macro, with timed steps:
+
+    delay:MSEC          pause for MSEC milliseconds
+    hold:MSEC:KEY       press KEY, and release it MSEC milliseconds later
+    repeat:N { ... }    do the steps between the braces N times
+
+    move:DX:DY          move the pointer by DX and DY
+    nudge:DX:DY         move the pointer by DX and DY every frame, for 
+                          as long as the button is held
+
+  so, for example:
+
+    22 repeat:3 { hold:200:DOWN delay:100 } ENTER
+
+  A nudge speeds up while the button is held, as set by the most recent
+    'accel RAMP_MSEC MAX [linear|quadratic]' line: over RAMP_MSEC, the 
+    speed rises to MAX times the starting speed. 'frame MSEC' sets how
+    often the pointer moves (every 10 msec by default).
+
+  An absolute axis, like a joystick's, can be driven by a number read 
+    from a file, usually an analog input in sysfs. The number is scaled
+    from the range IN_MIN to IN_MAX to the range OUT_MIN to OUT_MAX
+    (by default, the same as the input range), and read every frame:
+
+    axis X /sys/bus/iio/devices/iio:device0/in_voltage0_raw 0 4095 
+
+  Text in double quotes is typed as it is, using the keyboard layout
+    set by the most recent 'layout' line (US by default):
+
+    layout gb
+    23 "user@example.com\n"
+
+  By default, every key event is followed by its own SYN_REPORT. 
+    'sync step' groups events in the same direction into one report, 
+    and 'sync safe' does the same, but keeps modifiers in reports of
+    their own -- see SyncMode.
+
+  Normally all the events go to a single keyboard device. Further
+    uinput devices can be declared with 'device NAME TYPE', where TYPE 
+    is keyboard, consumer, gamepad or mouse, and the lines after it
+    send their events to that device; 'device NAME' on its own switches 
+    back to a device declared earlier. For example:
+
+    device pi-gamepad gamepad
+    24 BTN_SOUTH
+    device pi-media consumer
+    25 VOLUMEUP
+
+  Some programs lose keystrokes that arrive too quickly. 'pace RATE'
+    limits the macros on the lines after it to RATE reports per second 
+    (a report is usually one key press or release), and a rate after
+    the type on a 'device' line limits everything sent to that device.
+    'pace 0' removes the limit.
+
+  'priority urgent' makes the macros after it jump ahead of any normal
+    macros that are queued or playing, so a "stop" button isn't held up 
+    behind a long piece of text. 'priority cancel' does the same, but
+    also abandons the normal macros, releasing any keys they were 
+    holding down. 'priority normal' restores the default.
+
+  Anything after a '#' is a comment, and a line that ends with a
+    backslash continues on the next line.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <linux/input.h>
+#include "mapping.h"
+#include "layout.h"
+
+typedef struct _KeyName
+  {
+  const char *name;
+  int code;
+  } KeyName;
+
+// keynames.h is generated from input-event-codes.h by the Makefile
+static const KeyName keynames[] =
+  {
+#include "keynames.h"
+  {NULL, 0}
+  };
+
+// MapBuilder holds the parts of an image while it is being assembled.
+//   The steps of each macro are collected as Steps, as in the built-in 
+//   table, and converted into runs of events when the macro is complete.
+//   The arrays just grow as needed.
+typedef struct _MapBuilder
+  {
+  MapEntry *entries;
+  int nentries;
+  MapRun *runs;
+  int nruns;
+  struct input_event *events;
+  int nevents;
+  int events_alloc;
+  Step *steps;
+  int nsteps;
+  int steps_alloc;
+  MapDevice devices[MAX_DEVICES];
+  int ndevices;
+  int device;                   // The device new entries are sent to
+  MapAxis axes[MAX_AXES];
+  int naxes;
+  uint32_t frame_usec;
+  int sync_mode;
+  uint32_t accel_ramp_usec;     // Acceleration for new entries' nudges
+  uint32_t accel_max;
+  int accel_curve;
+  uint32_t pace_usec;           // Pacing for new entries
+  int priority;                 // Priority of new entries
+  } MapBuilder;
+
+// SyncMode controls how key events are grouped into SYN_REPORTs. Every
+//   report wakes up every program reading the device, so fewer reports
+//   is better, but some programs only work properly if each key event
+//   is in its own report.
+typedef enum _SyncMode
+  {
+  // A report after every key event. This is the default.
+  SYNC_KEY = 0,
+  // Key events in the same direction (all presses, or all releases)
+  //   share a report, so a modifier and the key it modifies are pressed
+  //   in the same report, as are the keys in a chord
+  SYNC_STEP,
+  // As SYNC_STEP, except that modifiers get their own report, before the
+  //   keys they modify are pressed and after they are released. This
+  //   suits programs that need the modifier to land before the key.
+  SYNC_SAFE
+  } SyncMode;
+
+// Sections in the image are aligned to this many bytes
+#define MAP_IMAGE_ALIGN 8
+
+// MAX_MACRO_STEPS limits the size of a macro after repeats have been
+//   expanded, so that a typo in a repeat count doesn't eat all the memory
+#define MAX_MACRO_STEPS 1000000
+
+// MAX_DELAY_MSEC is the longest single delay, which keeps the total
+//   pause after a run well within 32 bits of microseconds
+#define MAX_DELAY_MSEC 60000
+
+// MAX_REPEAT_DEPTH is how deeply repeat blocks can be nested
+#define MAX_REPEAT_DEPTH 8
+
+// The default time between updates of the pointer and absolute axes
+#define DEFAULT_FRAME_USEC 10000
+
+// MAX_PACE is the highest rate, in reports per second, that 'pace' can
+//   set
+#define MAX_PACE 100000
+
+// Limits on pointer movement in the config file, which keep the fixed
+//   point arithmetic in range
+#define MAX_MOVE 10000
+#define MAX_ACCEL 100
+
+// The absolute axes that can be driven from a file. The ABS_ prefix is
+//   optional in the config file.
+static const KeyName axisnames[] =
+  {
+  {"ABS_X", ABS_X}, {"ABS_Y", ABS_Y}, {"ABS_Z", ABS_Z},
+  {"ABS_RX", ABS_RX}, {"ABS_RY", ABS_RY}, {"ABS_RZ", ABS_RZ},
+  {"ABS_THROTTLE", ABS_THROTTLE}, {"ABS_RUDDER", ABS_RUDDER},
+  {"ABS_WHEEL", ABS_WHEEL}, {"ABS_GAS", ABS_GAS}, {"ABS_BRAKE", ABS_BRAKE},
+  {"ABS_HAT0X", ABS_HAT0X}, {"ABS_HAT0Y", ABS_HAT0Y},
+  {NULL, 0}
+  };
+
+// The name of the device that is created if the config file doesn't
+//   declare any
+#define DEFAULT_DEVICE_NAME "Dummy input device"
+
+static const char *device_type_names[] = 
+  {"keyboard", "consumer", "gamepad", "mouse", NULL};
+
+// The keyboard layout used to type text, if the config file doesn't
+//   say otherwise
+#define DEFAULT_LAYOUT "us"
+
+// The base and length of the image we mmap()ed, if any, so we can
+//   tell how to release it.
+static const void *mapped_base = NULL;
+static size_t mapped_len = 0;
+
+/*======================================================================
+  mapimage_checksum
+  Compute the 32-bit FNV-1a hash of an image, covering everything after
+    the checksum itself. This isn't a cryptographic check -- it only 
+    needs to detect truncated or corrupted files.
+======================================================================*/
+static uint32_t mapimage_checksum (const MapImage *image)
+  {
+  size_t start = offsetof (MapImage, checksum) + sizeof (image->checksum);
+  const unsigned char *p = (const unsigned char *)image;
+  uint32_t hash = 2166136261u;
+  for (size_t i = start; i < image->size; i++)
+    {
+    hash ^= p[i];
+    hash *= 16777619u;
+    }
+  return hash;
+  }
+
+/*======================================================================
+  mtime_nsec
+  Get a file's modification time in nanoseconds. Whole seconds aren't
+    enough: a config file can be edited in the same second that it was
+    compiled.
+======================================================================*/
+static int64_t mtime_nsec (const struct stat *sb)
+  {
+  return sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec;
+  }
+
+/*======================================================================
+  table_fits
+  Check that a table of 'n' items of 'size' bytes at offset 'off' lies
+    within an image of 'len' bytes, without any sum overflowing
+======================================================================*/
+static BOOL table_fits (uint32_t off, uint32_t n, size_t size, size_t len)
+  {
+  return off <= len && n <= (len - off) / size;
+  }
+
+/*======================================================================
+  align_up
+======================================================================*/
+static uint32_t align_up (uint32_t n)
+  {
+  return (n + MAP_IMAGE_ALIGN - 1) & ~(MAP_IMAGE_ALIGN - 1);
+  }
+
+/*======================================================================
+  mapbuilder_add_step
+  Add a step to the macro being built
+======================================================================*/
+static void mapbuilder_add_step (MapBuilder *b, int type, int code, 
+    int value)
+  {
+  if (b->nsteps == b->steps_alloc)
+    {
+    b->steps_alloc = b->steps_alloc ? b->steps_alloc * 2 : 64;
+    b->steps = realloc (b->steps, b->steps_alloc * sizeof (Step));
+    }
+  Step *step = &b->steps[b->nsteps++];
+  step->type = type;
+  step->code = code;
+  step->value = value;
+  }
+
+/*======================================================================
+  mapbuilder_add_key
+  Add a key press (value 1) or release (value 0) to the macro
+======================================================================*/
+static void mapbuilder_add_key (MapBuilder *b, int code, int value)
+  {
+  mapbuilder_add_step (b, EV_KEY, code, value);
+  }
+
+/*======================================================================
+  mapbuilder_add_delay
+======================================================================*/
+static void mapbuilder_add_delay (MapBuilder *b, int msec)
+  {
+  mapbuilder_add_step (b, STEP_DELAY, 0, msec);
+  }
+
+/*======================================================================
+  mapbuilder_add_event
+  Add an input event to the current run
+======================================================================*/
+static void mapbuilder_add_event (MapBuilder *b, int type, int code, 
+    int value)
+  {
+  if (b->nevents == b->events_alloc)
+    {
+    b->events_alloc = b->events_alloc ? b->events_alloc * 2 : 64;
+    b->events = realloc (b->events, 
+      b->events_alloc * sizeof (struct input_event));
+    }
+  struct input_event *ie = &b->events[b->nevents++];
+  memset (ie, 0, sizeof (struct input_event));
+  ie->type = type;
+  ie->code = code;
+  ie->value = value;
+  b->runs[b->nruns - 1].nevents++;
+  // Keep track of the capabilities the uinput device will need
+  MapDevice *d = &b->devices[b->entries[b->nentries - 1].device];
+  d->evbits |= 1 << type;
+  if (type == EV_KEY && code < KEY_CNT)
+    d->keybits[code / 8] |= 1 << (code % 8);
+  if (type == EV_REL && code < 32)
+    d->relbits |= 1 << code;
+  }
+
+/*======================================================================
+  mapbuilder_add_run
+======================================================================*/
+static void mapbuilder_add_run (MapBuilder *b)
+  {
+  b->runs = realloc (b->runs, (b->nruns + 1) * sizeof (MapRun));
+  MapRun *r = &b->runs[b->nruns++];
+  r->first_event = b->nevents;
+  r->nevents = 0;
+  r->delay_usec = 0;
+  b->entries[b->nentries - 1].nruns++;
+  }
+
+/*======================================================================
+  is_modifier
+======================================================================*/
+static BOOL is_modifier (int code)
+  {
+  switch (code)
+    {
+    case KEY_LEFTCTRL: case KEY_RIGHTCTRL:
+    case KEY_LEFTSHIFT: case KEY_RIGHTSHIFT:
+    case KEY_LEFTALT: case KEY_RIGHTALT:
+    case KEY_LEFTMETA: case KEY_RIGHTMETA:
+      return TRUE;
+    }
+  return FALSE;
+  }
+
+/*======================================================================
+  starts_group
+  Decide whether a key step has to start a new SYN_REPORT group, or 
+    can share a report with the steps before it. See SyncMode.
+======================================================================*/
+static BOOL starts_group (const MapBuilder *b, const Step *steps, 
+    int group_start, int i)
+  {
+  if (i == group_start) return TRUE;
+  const Step *step = &steps[i];
+  const Step *first = &steps[group_start];
+  // The X and Y parts of a pointer movement always go together
+  if (step->type == EV_REL && first->type == EV_REL)
+    return step->code == first->code;
+  if (b->sync_mode == SYNC_KEY) return TRUE;
+  if (step->type != EV_KEY || first->type != EV_KEY) return TRUE;
+  if (step->value != first->value) return TRUE;
+  if (b->sync_mode == SYNC_SAFE 
+       && is_modifier (step->code) != is_modifier (steps[i - 1].code))
+    return TRUE;
+  // A key can't change state twice in the same report
+  for (int j = group_start; j < i; j++)
+    if (steps[j].code == step->code) return TRUE;
+  return FALSE;
+  }
+
+/*======================================================================
+  mapbuilder_end_entry
+  Convert the steps of the current macro into runs of input events.
+    Key events are followed by a SYN_REPORT, just as if they had come 
+    from a real keyboard; depending on the sync mode, that's either
+    after every key event, or after each group of key events that 
+    could have happened at the same time. A delay ends the current
+    run; consecutive delays are added together.
+======================================================================*/
+static void mapbuilder_end_entry (MapBuilder *b)
+  {
+  if (b->nentries == 0) return;
+  BOOL in_run = FALSE;
+  int group_start = -1; // First step in the current report, if any
+  for (int i = 0; i < b->nsteps; i++)
+    {
+    const Step *step = &b->steps[i];
+    if (group_start >= 0 && (step->type == STEP_DELAY 
+         || starts_group (b, b->steps, group_start, i)))
+      {
+      mapbuilder_add_event (b, EV_SYN, SYN_REPORT, 0);
+      group_start = -1;
+      }
+    if (step->type == STEP_DELAY)
+      {
+      uint32_t usec = step->value * 1000;
+      // A very long string of delays can overflow a single run's delay,
+      //   in which case we just add an empty run to hold the excess
+      if (b->entries[b->nentries - 1].nruns == 0
+          || b->runs[b->nruns - 1].delay_usec + usec < usec)
+        mapbuilder_add_run (b);
+      b->runs[b->nruns - 1].delay_usec += usec;
+      in_run = FALSE;
+      }
+    else
+      {
+      if (!in_run) mapbuilder_add_run (b);
+      in_run = TRUE;
+      mapbuilder_add_event (b, step->type, step->code, step->value);
+      if (group_start < 0) group_start = i;
+      }
+    }
+  if (group_start >= 0)
+    mapbuilder_add_event (b, EV_SYN, SYN_REPORT, 0);
+  b->nsteps = 0;
+  }
+
+/*======================================================================
+  mapbuilder_init
+======================================================================*/
+static void mapbuilder_init (MapBuilder *b)
+  {
+  memset (b, 0, sizeof (MapBuilder));
+  b->frame_usec = DEFAULT_FRAME_USEC;
+  b->accel_max = MAP_FIXED_ONE;
+  }
+
+/*======================================================================
+  mapbuilder_add_device
+  Add a device, and make it the one that new entries are sent to.
+    Returns FALSE if there are too many.
+======================================================================*/
+static BOOL mapbuilder_add_device (MapBuilder *b, const char *name, 
+    int type)
+  {
+  if (b->ndevices == MAX_DEVICES) return FALSE;
+  MapDevice *d = &b->devices[b->ndevices];
+  memset (d, 0, sizeof (MapDevice));
+  strncpy (d->name, name, sizeof (d->name) - 1);
+  d->type = type;
+  b->device = b->ndevices++;
+  return TRUE;
+  }
+
+/*======================================================================
+  mapbuilder_add_entry
+  Start a new entry for the specified pin. Subsequent calls to
+    calls to add steps will add to this entry.
+======================================================================*/
+static void mapbuilder_add_entry (MapBuilder *b, int pin)
+  {
+  mapbuilder_end_entry (b);
+  if (b->ndevices == 0)
+    mapbuilder_add_device (b, DEFAULT_DEVICE_NAME, DEVICE_KEYBOARD);
+  b->entries = realloc (b->entries, (b->nentries + 1) * sizeof (MapEntry));
+  MapEntry *e = &b->entries[b->nentries++];
+  e->pin = pin;
+  e->first_run = b->nruns;
+  e->nruns = 0;
+  e->device = b->device;
+  e->nudge_x = 0;
+  e->nudge_y = 0;
+  e->accel_ramp_usec = b->accel_ramp_usec;
+  e->accel_max = b->accel_max;
+  e->accel_curve = b->accel_curve;
+  e->pace_usec = b->pace_usec;
+  e->priority = b->priority;
+  }
+
+/*======================================================================
+  mapbuilder_finish
+  Lay out the accumulated entries, runs, and events as a single block 
+    of memory, and fill in the header. The source modification time and
+    size identify the config file it came from, if any. The builder's 
+    own storage is freed. The caller must free() the result.
+======================================================================*/
+static MapImage *mapbuilder_finish (MapBuilder *b, int64_t source_mtime,
+    int64_t source_size)
+  {
+  mapbuilder_end_entry (b);
+  uint32_t entries_off = align_up (sizeof (MapImage));
+  uint32_t axes_off = align_up (entries_off
+    + b->nentries * sizeof (MapEntry));
+  uint32_t runs_off = align_up (axes_off + b->naxes * sizeof (MapAxis));
+  uint32_t events_off = align_up (runs_off + b->nruns * sizeof (MapRun));
+  uint32_t size = events_off + b->nevents * sizeof (struct input_event);
+
+  MapImage *image = calloc (1, size);
+  memcpy (image->magic, MAP_IMAGE_MAGIC, sizeof (image->magic));
+  image->version = MAP_IMAGE_VERSION;
+  image->size = size;
+  image->event_size = sizeof (struct input_event);
+  image->nentries = b->nentries;
+  image->entries_off = entries_off;
+  image->nruns = b->nruns;
+  image->runs_off = runs_off;
+  image->nevents = b->nevents;
+  image->events_off = events_off;
+  image->ndevices = b->ndevices;
+  memcpy (image->devices, b->devices, sizeof (image->devices));
+  image->frame_usec = b->frame_usec;
+  image->naxes = b->naxes;
+  image->axes_off = axes_off;
+  memcpy ((char *)image + axes_off, b->axes, b->naxes * sizeof (MapAxis));
+  memcpy ((char *)image + entries_off, b->entries,
+    b->nentries * sizeof (MapEntry));
+  memcpy ((char *)image + runs_off, b->runs, b->nruns * sizeof (MapRun));
+  memcpy ((char *)image + events_off, b->events, 
+    b->nevents * sizeof (struct input_event));
+  image->source_mtime = source_mtime;
+  image->source_size = source_size;
+  image->checksum = mapimage_checksum (image);
+
+  free (b->entries);
+  free (b->runs);
+  free (b->events);
+  free (b->steps);
+  memset (b, 0, sizeof (MapBuilder));
+  return image;
+  }
+
+/*======================================================================
+  mapimage_from_table
+  Build an image from a mapping table in the built-in format, that is,
+    an array of Mapping terminated by pin 0.
+======================================================================*/
+MapImage *mapimage_from_table (const Mapping *mappings)
+  {
+  MapBuilder b;
+  mapbuilder_init (&b);
+  for (const Mapping *m = mappings; m->pin != 0; m++)
+    {
+    mapbuilder_add_entry (&b, m->pin);
+    for (const Step *step = m->steps; step->type != STEP_END; step++)
+      mapbuilder_add_step (&b, step->type, step->code, step->value);
+    }
+  return mapbuilder_finish (&b, 0, 0);
+  }
+
+/*======================================================================
+  lookup_key
+  Find the scan code for a key name, with or without the KEY_ prefix.
+    Returns -1 if the name is unknown.
+======================================================================*/
+static int lookup_key (const char *name)
+  {
+  char prefixed[64];
+  snprintf (prefixed, sizeof (prefixed), "KEY_%s", name);
+  for (const KeyName *k = keynames; k->name; k++)
+    {
+    if (strcasecmp (k->name, name) == 0
+        || strcasecmp (k->name, prefixed) == 0)
+      return k->code;
+    }
+  return -1;
+  }
+
+// Parser holds the state of the config file parser
+typedef struct _Parser
+  {
+  MapBuilder b;
+  const char *filename;
+  int lineno;
+  const Layout *layout;         // Layout for typing text
+  int sync_mode;                // See SyncMode
+  int repeat_depth;             // 'repeat' blocks open on this line
+  int repeat_start[MAX_REPEAT_DEPTH]; // Index of the first step in each...
+  long repeat_count[MAX_REPEAT_DEPTH]; // ...and the times to do it
+  long repeat_pending;          // 'repeat:' still waiting for its '{'
+  } Parser;
+
+/*======================================================================
+  config_error
+  Report a fatal error in the config file. As with any other problem
+    with setting up, there's nothing useful we can do but exit.
+======================================================================*/
+static void config_error (const Parser *ps, const char *msg, 
+    const char *item)
+  {
+  fprintf (stderr, "%s:%d: %s '%s'\n", ps->filename, ps->lineno, msg, item);
+  exit (-1);
+  }
+
+/*======================================================================
+  next_token
+  Return the next whitespace-delimited token from the line, and
+    advance the line pointer past it. The token is terminated in
+    place. Returns NULL at the end of the line, or at a comment.
+  A token in double quotes is a text string, which can contain 
+    spaces, and the escapes \n, \t, \" and \\. The string is unescaped
+    in place, and returned with its opening quote, so the caller can 
+    tell it from a key name.
+======================================================================*/
+static char *next_token (const Parser *ps, char **line)
+  {
+  char *p = *line;
+  while (*p == ' ' || *p == '\t') p++;
+  if (*p == 0 || *p == '#') return NULL;
+  char *token = p;
+  if (*p == '"')
+    {
+    char *out = ++p;
+    while (*p != '"')
+      {
+      if (*p == 0) config_error (ps, "Missing closing quote in", token);
+      if (*p == '\\')
+        {
+        p++;
+        if (*p == 'n') *out++ = '\n';
+        else if (*p == 't') *out++ = '\t';
+        else if (*p == '"' || *p == '\\') *out++ = *p;
+        else config_error (ps, "Bad escape in", token);
+        p++;
+        }
+      else
+        *out++ = *p++;
+      }
+    *out = 0;
+    p++;
+    }
+  else
+    {
+    while (*p && *p != ' ' && *p != '\t' && *p != '#') p++;
+    }
+  if (*p == '#')
+    *p = 0; // The comment runs to the end of the line anyway
+  else if (*p)
+    *p++ = 0;
+  *line = p;
+  return token;
+  }
+
+/*======================================================================
+  read_line
+  Read a logical line from the config file, joining physical lines
+    that end in a backslash. The line number is advanced by the number
+    of physical lines read. Returns NULL at end of file. The caller
+    must free() the result.
+======================================================================*/
+static char *read_line (FILE *f, int *lineno)
+  {
+  char *line = NULL;
+  size_t len = 0;
+  char *buff = NULL;
+  size_t buff_size = 0;
+  ssize_t n;
+  while ((n = getline (&buff, &buff_size, f)) >= 0)
+    {
+    (*lineno)++;
+    while (n > 0 && (buff[n - 1] == '\n' || buff[n - 1] == '\r'))
+      buff[--n] = 0;
+    BOOL more = (n > 0 && buff[n - 1] == '\\');
+    if (more) buff[--n] = ' ';
+    line = realloc (line, len + n + 1);
+    memcpy (line + len, buff, n + 1);
+    len += n;
+    if (!more) break;
+    }
+  free (buff);
+  return line;
+  }
+
+/*======================================================================
+  parse_key
+  Look up a key name from the config file. An unknown name is fatal.
+======================================================================*/
+static int parse_key (const Parser *ps, const char *name)
+  {
+  int code = lookup_key (name);
+  if (code < 0)
+    config_error (ps, "Unknown key name", name);
+  return code;
+  }
+
+/*======================================================================
+  parse_number
+  Parse a number that must be within the specified range. Returns 
+    a pointer to the character after the number.
+======================================================================*/
+static char *parse_number (const Parser *ps, char *s, long min, long max, 
+    long *n)
+  {
+  char *end;
+  *n = strtol (s, &end, 10);
+  if (end == s || *n < min || *n > max)
+    config_error (ps, "Bad number in", s);
+  return end;
+  }
+
+/*======================================================================
+  add_modifiers
+  Press or release the modifier keys in 'mods'
+======================================================================*/
+static void add_modifiers (MapBuilder *b, int mods, int value)
+  {
+  if (mods & LAYOUT_SHIFT) mapbuilder_add_key (b, KEY_LEFTSHIFT, value);
+  if (mods & LAYOUT_ALTGR) mapbuilder_add_key (b, KEY_RIGHTALT, value);
+  }
+
+/*======================================================================
+  parse_text
+  Convert a text string from the config file into the keystrokes that 
+    would type it, using the current layout. Modifiers are held down 
+    for as long as consecutive characters need them, rather than being
+    pressed and released around every character, so the keystrokes 
+    for "ABC" are Shift+, A, B, C, Shift-.
+======================================================================*/
+static void parse_text (Parser *ps, const char *text)
+  {
+  MapBuilder *b = &ps->b;
+  const char *s = text;
+  int held = 0;
+  uint32_t ch;
+  int rc;
+  while ((rc = utf8_next_char (&s, &ch)) > 0)
+    {
+    const LayoutKey *k = layout_lookup (ps->layout, ch);
+    if (!k)
+      {
+      char msg[80];
+      snprintf (msg, sizeof (msg), "Can't type U+%04X with layout '%s' in",
+        ch, ps->layout->name);
+      config_error (ps, msg, text);
+      }
+    int mods = k->mods & (LAYOUT_SHIFT | LAYOUT_ALTGR);
+    if (mods != held)
+      {
+      add_modifiers (b, held & ~mods, 0);
+      add_modifiers (b, mods & ~held, 1);
+      held = mods;
+      }
+    mapbuilder_add_key (b, k->code, 1);
+    mapbuilder_add_key (b, k->code, 0);
+    if (k->mods & LAYOUT_DEAD)
+      {
+      // AltGr+Space is a no-break space in some layouts, which not every
+      //   dead key combines with
+      if (held & LAYOUT_ALTGR)
+        {
+        add_modifiers (b, LAYOUT_ALTGR, 0);
+        held &= ~LAYOUT_ALTGR;
+        }
+      mapbuilder_add_key (b, KEY_SPACE, 1);
+      mapbuilder_add_key (b, KEY_SPACE, 0);
+      }
+    }
+  if (rc < 0)
+    config_error (ps, "Invalid UTF-8 in", text);
+  add_modifiers (b, held, 0);
+  }
+
+/*======================================================================
+  parse_step
+  Parse a single step of a macro from the config file, adding one or 
+    more steps to the current entry.
+======================================================================*/
+static void parse_step (Parser *ps, char *token)
+  {
+  MapBuilder *b = &ps->b;
+  long n, msec;
+  if (ps->repeat_pending && strcmp (token, "{") != 0)
+    config_error (ps, "Expected '{' before", token);
+
+  if (token[0] == '"')
+    {
+    parse_text (ps, token + 1);
+    }
+  else if (strcmp (token, "{") == 0)
+    {
+    if (ps->repeat_depth == MAX_REPEAT_DEPTH)
+      config_error (ps, "Repeats nested too deeply at", token);
+    ps->repeat_start[ps->repeat_depth] = b->nsteps;
+    ps->repeat_count[ps->repeat_depth] = 
+      ps->repeat_pending ? ps->repeat_pending : 1;
+    ps->repeat_depth++;
+    ps->repeat_pending = 0;
+    }
+  else if (strcmp (token, "}") == 0)
+    {
+    if (ps->repeat_depth == 0)
+      config_error (ps, "Unmatched", token);
+    ps->repeat_depth--;
+    int start = ps->repeat_start[ps->repeat_depth];
+    long count = ps->repeat_count[ps->repeat_depth];
+    int len = b->nsteps - start;
+    if ((long)len * count > MAX_MACRO_STEPS)
+      config_error (ps, "Macro too long at", token);
+    for (long r = 1; r < count; r++)
+      for (int i = 0; i < len; i++)
+        {
+        Step step = b->steps[start + i]; // steps may be realloc()ed
+        mapbuilder_add_step (b, step.type, step.code, step.value);
+        }
+    }
+  else if (strncmp (token, "repeat:", 7) == 0)
+    {
+    if (*parse_number (ps, token + 7, 1, MAX_MACRO_STEPS, &n))
+      config_error (ps, "Bad number in", token);
+    ps->repeat_pending = n;
+    }
+  else if (strncmp (token, "delay:", 6) == 0)
+    {
+    if (*parse_number (ps, token + 6, 0, MAX_DELAY_MSEC, &msec))
+      config_error (ps, "Bad number in", token);
+    mapbuilder_add_delay (b, msec);
+    }
+  else if (strncmp (token, "move:", 5) == 0 
+           || strncmp (token, "nudge:", 6) == 0)
+    {
+    long dx, dy;
+    char *p = parse_number (ps, strchr (token, ':') + 1, -MAX_MOVE, 
+      MAX_MOVE, &dx);
+    if (*p != ':')
+      config_error (ps, "Expected DX:DY in", token);
+    p = parse_number (ps, p + 1, -MAX_MOVE, MAX_MOVE, &dy);
+    if (*p)
+      config_error (ps, "Expected DX:DY in", token);
+    if (token[0] == 'n')
+      {
+      MapEntry *e = &b->entries[b->nentries - 1];
+      if (mapentry_has_nudge (e) || (dx == 0 && dy == 0))
+        config_error (ps, "Only one non-zero nudge allowed, at", token);
+      e->nudge_x = dx;
+      e->nudge_y = dy;
+      b->devices[e->device].evbits |= 1 << EV_REL;
+      b->devices[e->device].relbits |= (1 << REL_X) | (1 << REL_Y);
+      }
+    else
+      {
+      if (dx) mapbuilder_add_step (b, EV_REL, REL_X, dx);
+      if (dy) mapbuilder_add_step (b, EV_REL, REL_Y, dy);
+      }
+    }
+  else if (strncmp (token, "hold:", 5) == 0)
+    {
+    char *p = parse_number (ps, token + 5, 0, MAX_DELAY_MSEC, &msec);
+    if (*p != ':')
+      config_error (ps, "Expected hold:MSEC:KEY, not", token);
+    int code = parse_key (ps, p + 1);
+    mapbuilder_add_key (b, code, 1);
+    mapbuilder_add_delay (b, msec);
+    mapbuilder_add_key (b, code, 0);
+    }
+  else
+    {
+    size_t len = strlen (token);
+    char suffix = token[len - 1];
+    if (len > 1 && (suffix == '+' || suffix == '-'))
+      token[len - 1] = 0;
+    else
+      suffix = 0;
+
+    int code = parse_key (ps, token);
+    if (suffix != '-') mapbuilder_add_key (b, code, 1);
+    if (suffix != '+') mapbuilder_add_key (b, code, 0);
+    }
+
+  if (b->nsteps > MAX_MACRO_STEPS)
+    config_error (ps, "Macro too long at", token);
+  }
+
+/*======================================================================
+  parse_mapping
+  Parse a line that maps a GPIO pin to a macro
+======================================================================*/
+static void parse_mapping (Parser *ps, char *pin_token, char *p)
+  {
+  MapBuilder *b = &ps->b;
+  char *end;
+  long pin = strtol (pin_token, &end, 10);
+  if (*end || pin <= 0)
+    config_error (ps, "Bad GPIO pin number", pin_token);
+  for (int i = 0; i < b->nentries; i++)
+    {
+    if (b->entries[i].pin == pin)
+      config_error (ps, "Duplicate GPIO pin", pin_token);
+    }
+  if (b->nentries == MAX_PINS)
+    config_error (ps, "Too many GPIO pins at", pin_token);
+
+  mapbuilder_add_entry (b, pin);
+  ps->repeat_depth = 0;
+  ps->repeat_pending = 0;
+  char *token;
+  while ((token = next_token (ps, &p)))
+    parse_step (ps, token);
+  if (ps->repeat_depth || ps->repeat_pending)
+    config_error (ps, "Missing '}' for pin", pin_token);
+  if (b->nsteps == 0 && !mapentry_has_nudge (&b->entries[b->nentries - 1]))
+    config_error (ps, "No keystrokes for pin", pin_token);
+  // Convert the steps now, while the current settings apply
+  b->sync_mode = ps->sync_mode;
+  mapbuilder_end_entry (b);
+  }
+
+/*======================================================================
+  parse_pace
+  Parse a rate in reports per second, and return the time between
+    reports in microseconds, or 0 for no limit
+======================================================================*/
+static uint32_t parse_pace (const Parser *ps, char *rate)
+  {
+  long n;
+  if (*parse_number (ps, rate, 0, MAX_PACE, &n))
+    config_error (ps, "Bad number in", rate);
+  return n ? 1000000 / n : 0;
+  }
+
+/*======================================================================
+  parse_device
+  Parse the values of a 'device' line: a name, and optionally a type.
+    If there is a type, this declares a new device.
+======================================================================*/
+static void parse_device (Parser *ps, char *name, char *p)
+  {
+  MapBuilder *b = &ps->b;
+  char *type_name = next_token (ps, &p);
+  // The name can be quoted, if it has spaces in it
+  if (name[0] == '"') name++;
+  if (strlen (name) >= sizeof (b->devices[0].name))
+    config_error (ps, "Device name too long", name);
+  if (name[0] == 0 || strpbrk (name, "\"\\\n\t"))
+    config_error (ps, "Bad device name", name);
+  int i;
+  for (i = 0; i < b->ndevices; i++)
+    {
+    if (strcmp (b->devices[i].name, name) == 0) break;
+    }
+  if (!type_name)
+    {
+    if (i == b->ndevices)
+      config_error (ps, "Unknown device", name);
+    b->device = i;
+    return;
+    }
+  if (i < b->ndevices)
+    config_error (ps, "Duplicate device", name);
+  int type;
+  for (type = 0; device_type_names[type]; type++)
+    {
+    if (strcmp (device_type_names[type], type_name) == 0) break;
+    }
+  if (!device_type_names[type])
+    config_error (ps, "Unknown device type", type_name);
+  if (!mapbuilder_add_device (b, name, type))
+    config_error (ps, "Too many devices at", name);
+  char *rate = next_token (ps, &p);
+  if (rate)
+    b->devices[b->device].pace_usec = parse_pace (ps, rate);
+  if (next_token (ps, &p))
+    config_error (ps, "Too many values for device", name);
+  }
+
+/*======================================================================
+  parse_accel
+  Parse the values of an 'accel' line: the ramp time, the maximum
+    speed-up, which can have a fraction, and optionally the curve
+======================================================================*/
+static void parse_accel (Parser *ps, char *value, char *p)
+  {
+  MapBuilder *b = &ps->b;
+  long msec;
+  if (*parse_number (ps, value, 0, MAX_DELAY_MSEC, &msec))
+    config_error (ps, "Bad number in", value);
+  char *max_token = next_token (ps, &p);
+  if (!max_token)
+    config_error (ps, "No maximum speed for", "accel");
+  char *end;
+  double max = strtod (max_token, &end);
+  if (*end || !(max >= 1 && max <= MAX_ACCEL))
+    config_error (ps, "Bad acceleration", max_token);
+  char *curve = next_token (ps, &p);
+  b->accel_curve = ACCEL_LINEAR;
+  if (curve)
+    {
+    if (strcmp (curve, "quadratic") == 0) 
+      b->accel_curve = ACCEL_QUADRATIC;
+    else if (strcmp (curve, "linear") != 0)
+      config_error (ps, "Unknown acceleration curve", curve);
+    if (next_token (ps, &p))
+      config_error (ps, "Too many values for", "accel");
+    }
+  b->accel_ramp_usec = msec * 1000;
+  b->accel_max = max * MAP_FIXED_ONE + 0.5;
+  }
+
+/*======================================================================
+  parse_axis
+  Parse the values of an 'axis' line: the axis name, the file to read,
+    the input range, and optionally the output range
+======================================================================*/
+static void parse_axis (Parser *ps, char *name, char *p)
+  {
+  MapBuilder *b = &ps->b;
+  if (b->naxes == MAX_AXES)
+    config_error (ps, "Too many axes at", name);
+  int code = -1;
+  for (const KeyName *k = axisnames; k->name; k++)
+    {
+    if (strcasecmp (k->name, name) == 0
+        || strcasecmp (k->name + 4, name) == 0)
+      code = k->code;
+    }
+  if (code < 0)
+    config_error (ps, "Unknown axis", name);
+  if (b->ndevices == 0)
+    mapbuilder_add_device (b, DEFAULT_DEVICE_NAME, DEVICE_KEYBOARD);
+  for (int i = 0; i < b->naxes; i++)
+    {
+    if (b->axes[i].device == b->device && b->axes[i].code == code)
+      config_error (ps, "Duplicate axis", name);
+    }
+
+  MapAxis *a = &b->axes[b->naxes];
+  memset (a, 0, sizeof (MapAxis));
+  a->device = b->device;
+  a->code = code;
+  char *path = next_token (ps, &p);
+  if (!path)
+    config_error (ps, "No file for axis", name);
+  if (path[0] == '"') path++;
+  if (strlen (path) >= sizeof (a->path) || strpbrk (path, "\"\\\n\t"))
+    config_error (ps, "Bad file name", path);
+  strcpy (a->path, path);
+
+  long range[4];
+  int n;
+  char *token;
+  for (n = 0; (token = next_token (ps, &p)); n++)
+    {
+    if (n == 4)
+      config_error (ps, "Too many values for axis", name);
+    if (*parse_number (ps, token, -INT32_MAX, INT32_MAX, &range[n]))
+      config_error (ps, "Bad number in", token);
+    }
+  if (n != 2 && n != 4)
+    config_error (ps, "Expected an input range, and optionally an output "
+      "range, for axis", name);
+  if (n == 2)
+    {
+    range[2] = range[0];
+    range[3] = range[1];
+    }
+  if (range[0] == range[1] || range[2] == range[3])
+    config_error (ps, "Empty range for axis", name);
+  a->in_min = range[0];
+  a->in_max = range[1];
+  a->out_min = range[2];
+  a->out_max = range[3];
+  b->devices[b->device].evbits |= 1 << EV_ABS;
+  b->naxes++;
+  }
+
+/*======================================================================
+  parse_directive
+  Parse a line that sets an option, rather than mapping a pin. The
+    option applies to all the lines that follow it. The options are:
+
+    layout NAME         keyboard layout used to type text
+    sync key|step|safe  how key events are grouped into reports
+    device NAME [TYPE [RATE]]  the device that events are sent to
+    pace RATE           most reports per second from each macro
+    priority normal|urgent|cancel  whether macros jump the queue
+    accel RAMP MAX [CURVE]  acceleration of nudges
+    frame MSEC          time between pointer and axis updates -- this
+                          applies to the whole file
+    axis NAME FILE MIN MAX [MIN MAX]  an absolute axis
+======================================================================*/
+static void parse_directive (Parser *ps, char *name, char *p)
+  {
+  char *value = next_token (ps, &p);
+  if (!value)
+    config_error (ps, "No value for", name);
+  if (strcmp (name, "device") == 0)
+    {
+    parse_device (ps, value, p);
+    return;
+    }
+  if (strcmp (name, "accel") == 0)
+    {
+    parse_accel (ps, value, p);
+    return;
+    }
+  if (strcmp (name, "axis") == 0)
+    {
+    parse_axis (ps, value, p);
+    return;
+    }
+  if (strcmp (name, "layout") == 0)
+    {
+    ps->layout = layout_find (value);
+    if (!ps->layout)
+      config_error (ps, "Unknown keyboard layout", value);
+    }
+  else if (strcmp (name, "sync") == 0)
+    {
+    if (strcmp (value, "key") == 0) ps->sync_mode = SYNC_KEY;
+    else if (strcmp (value, "step") == 0) ps->sync_mode = SYNC_STEP;
+    else if (strcmp (value, "safe") == 0) ps->sync_mode = SYNC_SAFE;
+    else config_error (ps, "Unknown sync mode", value);
+    }
+  else if (strcmp (name, "pace") == 0)
+    {
+    ps->b.pace_usec = parse_pace (ps, value);
+    }
+  else if (strcmp (name, "priority") == 0)
+    {
+    if (strcmp (value, "normal") == 0) ps->b.priority = PRIORITY_NORMAL;
+    else if (strcmp (value, "urgent") == 0) ps->b.priority = PRIORITY_URGENT;
+    else if (strcmp (value, "cancel") == 0) ps->b.priority = PRIORITY_CANCEL;
+    else config_error (ps, "Unknown priority", value);
+    }
+  else if (strcmp (name, "frame") == 0)
+    {
+    long msec;
+    if (*parse_number (ps, value, 1, 1000, &msec))
+      config_error (ps, "Bad number in", value);
+    ps->b.frame_usec = msec * 1000;
+    }
+  else
+    config_error (ps, "Unknown setting", name);
+  if (next_token (ps, &p))
+    config_error (ps, "Too many values for", name);
+  }
+
+/*======================================================================
+  mapimage_from_config
+  Parse a text configuration file, and build an image from it. Any
+    error in the file is fatal.
+======================================================================*/
+MapImage *mapimage_from_config (const char *filename)
+  {
+  FILE *f = fopen (filename, "r");
+  if (!f)
+    {
+    fprintf (stderr, "Can't open %s: %s\n", filename, strerror (errno));
+    exit (-1);
+    }
+
+  struct stat sb;
+  fstat (fileno (f), &sb);
+
+  Parser ps;
+  memset (&ps, 0, sizeof (ps));
+  mapbuilder_init (&ps.b);
+  ps.filename = filename;
+  ps.layout = layout_find (DEFAULT_LAYOUT);
+  char *line;
+  while ((line = read_line (f, &ps.lineno)))
+    {
+    char *p = line;
+    char *token = next_token (&ps, &p);
+    if (token)
+      {
+      if (token[0] >= '0' && token[0] <= '9')
+        parse_mapping (&ps, token, p);
+      else
+        parse_directive (&ps, token, p);
+      }
+    free (line);
+    }
+  fclose (f);
+
+  if (ps.b.nentries == 0 && ps.b.naxes == 0)
+    config_error (&ps, "No mappings in", filename);
+
+  return mapbuilder_finish (&ps.b, mtime_nsec (&sb), sb.st_size);
+  }
+
+/*======================================================================
+  mapimage_validate
+  Check that a block of memory really is a complete, uncorrupted
+    image, in a format that this version of the program understands.
+    Returns NULL if it is OK, or a description of the problem. The 
+    checksum only catches accidents, so everything the output thread
+    uses as an index -- devices, runs, event types and codes -- is 
+    checked as well.
+======================================================================*/
+static const char *mapimage_validate (const MapImage *image, size_t len)
+  {
+  if (len < sizeof (MapImage)
+      || memcmp (image->magic, MAP_IMAGE_MAGIC, sizeof (image->magic)))
+    return "not a mapping image";
+  if (image->version != MAP_IMAGE_VERSION)
+    return "wrong image version";
+  if (image->size != len)
+    return "image is truncated";
+  if (image->checksum != mapimage_checksum (image))
+    return "bad checksum";
+  if (image->event_size != sizeof (struct input_event))
+    return "image built for a different architecture";
+  if ((image->nentries == 0 && image->naxes == 0) 
+      || image->nentries > MAX_PINS || image->naxes > MAX_AXES
+      || image->frame_usec == 0
+      || !table_fits (image->entries_off, image->nentries, 
+            sizeof (MapEntry), len)
+      || !table_fits (image->axes_off, image->naxes, sizeof (MapAxis), len)
+      || !table_fits (image->runs_off, image->nruns, sizeof (MapRun), len)
+      || !table_fits (image->events_off, image->nevents, 
+            sizeof (struct input_event), len)
+      || image->ndevices == 0 || image->ndevices > MAX_DEVICES)
+    return "bad table sizes";
+  for (int d = 0; d < image->ndevices; d++)
+    {
+    const MapDevice *device = &image->devices[d];
+    if (device->type > DEVICE_MOUSE
+        || memchr (device->name, 0, sizeof (device->name)) == NULL)
+      return "bad device";
+    }
+  for (int i = 0; i < image->nentries; i++)
+    {
+    const MapEntry *e = mapimage_entry (image, i);
+    // Written so that a huge count can't wrap round and pass
+    if (e->first_run > image->nruns 
+        || e->nruns > image->nruns - e->first_run
+        || e->device >= image->ndevices
+        || e->accel_curve > ACCEL_QUADRATIC
+        || e->priority > PRIORITY_CANCEL)
+      return "bad entry";
+    }
+  const MapRun *runs = (const MapRun *)((const char *)image 
+    + image->runs_off);
+  for (int r = 0; r < image->nruns; r++)
+    {
+    if (runs[r].first_event > image->nevents
+        || runs[r].nevents > image->nevents - runs[r].first_event)
+      return "bad run";
+    }
+  // Macros only have the events that mapbuilder_add_event() can make
+  const struct input_event *events = (const struct input_event *)
+    ((const char *)image + image->events_off);
+  for (int i = 0; i < image->nevents; i++)
+    {
+    const struct input_event *ev = &events[i];
+    if (!(ev->type == EV_SYN && ev->code == SYN_REPORT)
+        && !(ev->type == EV_KEY && ev->code < KEY_CNT)
+        && !(ev->type == EV_REL && ev->code < 32))
+      return "bad event";
+    }
+  for (int i = 0; i < image->naxes; i++)
+    {
+    const MapAxis *a = mapimage_axis (image, i);
+    if (a->device >= image->ndevices || a->code > ABS_MAX
+        || a->in_min == a->in_max
+        || memchr (a->path, 0, sizeof (a->path)) == NULL)
+      return "bad axis";
+    }
+  return NULL;
+  }
+
+/*======================================================================
+  mapimage_map
+  mmap() an image file read-only, and check that it is usable. Returns
+    NULL if the file can't be read or is invalid -- the reason is
+    logged, but it is up to the caller whether that is fatal.
+======================================================================*/
+const MapImage *mapimage_map (const char *filename)
+  {
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    {
+    dbglog ("Can't open %s: %s\n", filename, strerror (errno));
+    return NULL;
+    }
+  struct stat sb;
+  fstat (fd, &sb);
+  void *base = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (base == MAP_FAILED)
+    {
+    dbglog ("Can't mmap %s: %s\n", filename, strerror (errno));
+    return NULL;
+    }
+
+  const char *problem = mapimage_validate (base, sb.st_size);
+  if (problem)
+    {
+    dbglog ("Can't use %s: %s\n", filename, problem);
+    munmap (base, sb.st_size);
+    return NULL;
+    }
+
+  mapped_base = base;
+  mapped_len = sb.st_size;
+  return base;
+  }
+
+/*======================================================================
+  mapimage_is_current
+  Returns TRUE if the image was built from the specified config file,
+    in its present state.
+======================================================================*/
+BOOL mapimage_is_current (const MapImage *image, const char *config)
+  {
+  struct stat sb;
+  if (stat (config, &sb) != 0) return FALSE;
+  return image->source_mtime == mtime_nsec (&sb)
+    && image->source_size == sb.st_size;
+  }
+
+/*======================================================================
+  mapimage_write
+  Write an image to a file. We write to a temporary file and rename it,
+    so that a daemon starting up concurrently, or a power failure,
+    can never leave a half-written image in place. Returns FALSE, 
+    having said why, if the image can't be written.
+======================================================================*/
+BOOL mapimage_write (const MapImage *image, const char *filename)
+  {
+  char *tmp = malloc (strlen (filename) + 8);
+  sprintf (tmp, "%s.tmp", filename);
+  int fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  BOOL ok = fd >= 0
+    && write (fd, image, image->size) == image->size
+    && fsync (fd) == 0;
+  if (fd >= 0 && close (fd) != 0) ok = FALSE;
+  if (ok && rename (tmp, filename) != 0) ok = FALSE;
+  if (!ok)
+    {
+    fprintf (stderr, "Can't write %s: %s\n", filename, strerror (errno));
+    if (fd >= 0) unlink (tmp);
+    }
+  free (tmp);
+  return ok;
+  }
+
+/*======================================================================
+  mapimage_write_c
+  Write an image as a C source file, for building a version of the 
+    program with its mappings compiled in. The image is laid out as a
+    static const structure with the same layout as a mapped image, so
+    all the code that uses an image works unchanged, and there is a
+    switch statement to find the entry for a pin. 'source' is just
+    the name of the config file, for the comment at the top.
+======================================================================*/
+void mapimage_write_c (const MapImage *image, const char *filename,
+    const char *source)
+  {
+  FILE *f = fopen (filename, "w");
+  if (!f)
+    {
+    fprintf (stderr, "Can't write %s: %s\n", filename, strerror (errno));
+    exit (-1);
+    }
+
+  fprintf (f, "// Generated by pi-button-to-kbd from %s -- do not edit\n",
+    source);
+  fprintf (f, "#include <stddef.h>\n#include \"mapping.h\"\n\n");
+  fprintf (f, "typedef struct _FixedImage\n  {\n  MapImage header;\n");
+  fprintf (f, "  MapEntry entries[%d];\n", image->nentries);
+  fprintf (f, "  MapAxis axes[%d];\n", image->naxes);
+  fprintf (f, "  MapRun runs[%d];\n", image->nruns);
+  fprintf (f, "  struct input_event events[%d];\n", image->nevents);
+  fprintf (f, "  } FixedImage;\n\n");
+
+  fprintf (f, "static const FixedImage image =\n  {\n  {\n");
+  fprintf (f, "  .magic = MAP_IMAGE_MAGIC,\n");
+  fprintf (f, "  .version = MAP_IMAGE_VERSION,\n");
+  fprintf (f, "  .size = sizeof (FixedImage),\n");
+  fprintf (f, "  .event_size = sizeof (struct input_event),\n");
+  fprintf (f, "  .nentries = %d,\n", image->nentries);
+  fprintf (f, "  .entries_off = offsetof (FixedImage, entries),\n");
+  fprintf (f, "  .nruns = %d,\n", image->nruns);
+  fprintf (f, "  .runs_off = offsetof (FixedImage, runs),\n");
+  fprintf (f, "  .nevents = %d,\n", image->nevents);
+  fprintf (f, "  .events_off = offsetof (FixedImage, events),\n");
+  fprintf (f, "  .ndevices = %d,\n", image->ndevices);
+  fprintf (f, "  .devices =\n    {\n");
+  for (int d = 0; d < image->ndevices; d++)
+    {
+    const MapDevice *dev = &image->devices[d];
+    fprintf (f, "    {\n    .name = \"%s\",\n", dev->name);
+    fprintf (f, "    .type = %u,\n", dev->type);
+    fprintf (f, "    .evbits = 0x%08X,\n", dev->evbits);
+    fprintf (f, "    .relbits = 0x%08X,\n", dev->relbits);
+    fprintf (f, "    .pace_usec = %u,\n", dev->pace_usec);
+    fprintf (f, "    .keybits =\n      {");
+    for (int i = 0; i < sizeof (dev->keybits); i++)
+      fprintf (f, "%s0x%02X", i % 12 ? ", " : (i ? ",\n      " : ""), 
+        dev->keybits[i]);
+    fprintf (f, "}\n    },\n");
+    }
+  fprintf (f, "    },\n");
+  fprintf (f, "  .frame_usec = %u,\n", image->frame_usec);
+  fprintf (f, "  .naxes = %d,\n", image->naxes);
+  fprintf (f, "  .axes_off = offsetof (FixedImage, axes),\n");
+  fprintf (f, "  },\n");
+
+  fprintf (f, "  {\n");
+  for (int i = 0; i < image->nentries; i++)
+    {
+    const MapEntry *e = mapimage_entry (image, i);
+    fprintf (f, "  {%d, %u, %u, %u, %d, %d, %u, %u, %u, %u, %u},\n", 
+      e->pin, e->first_run, e->nruns, e->device, e->nudge_x, e->nudge_y, 
+      e->accel_ramp_usec, e->accel_max, e->accel_curve, e->pace_usec,
+      e->priority);
+    }
+  fprintf (f, "  },\n  {\n");
+  for (int i = 0; i < image->naxes; i++)
+    {
+    const MapAxis *a = mapimage_axis (image, i);
+    fprintf (f, "  {%u, %u, %d, %d, %d, %d, \"%s\"},\n", a->device, 
+      a->code, a->in_min, a->in_max, a->out_min, a->out_max, a->path);
+    }
+  fprintf (f, "  },\n  {\n");
+  const MapRun *runs = (const MapRun *)((const char *)image 
+    + image->runs_off);
+  for (int i = 0; i < image->nruns; i++)
+    fprintf (f, "  {%u, %u, %u},\n", runs[i].first_event, runs[i].nevents, 
+      runs[i].delay_usec);
+  fprintf (f, "  },\n  {\n");
+  const struct input_event *events = (const struct input_event *)
+    ((const char *)image + image->events_off);
+  for (int i = 0; i < image->nevents; i++)
+    fprintf (f, "  {.type = %d, .code = %d, .value = %d},\n", 
+      events[i].type, events[i].code, events[i].value);
+  fprintf (f, "  }\n  };\n\n");
+
+  fprintf (f, "const MapImage *fixed_image (void)\n  {\n");
+  fprintf (f, "  return &image.header;\n  }\n\n");
+  fprintf (f, "const MapEntry *fixed_find_pin (int pin)\n  {\n");
+  fprintf (f, "  switch (pin)\n    {\n");
+  for (int i = 0; i < image->nentries; i++)
+    fprintf (f, "    case %d: return &image.entries[%d];\n", 
+      mapimage_entry (image, i)->pin, i);
+  fprintf (f, "    }\n  return NULL;\n  }\n");
+
+  if (fclose (f) != 0)
+    {
+    fprintf (stderr, "Can't write %s: %s\n", filename, strerror (errno));
+    exit (-1);
+    }
+  }
+
+/*======================================================================
+  mapimage_release
+  Free or unmap an image, depending on where it came from
+======================================================================*/
+void mapimage_release (const MapImage *image)
+  {
+  if (image == mapped_base)
+    {
+    munmap ((void *)mapped_base, mapped_len);
+    mapped_base = NULL;
+    }
+  else
+    free ((void *)image);
+  }
+
+/*======================================================================
+  mapimage_find_pin
+  Get the entry in the image that corresponds to a specific GPIO pin,
+    or NULL if there isn't one.
+======================================================================*/
+const MapEntry *mapimage_find_pin (const MapImage *image, int pin)
+  {
+  for (int i = 0; i < image->nentries; i++)
+    {
+    const MapEntry *e = mapimage_entry (image, i);
+    if (e->pin == pin) return e;
+    }
+  return NULL;
+  }
+
+/*======================================================================
+  device_type_name
+  Get the name of a DeviceType, as used in the config file
+======================================================================*/
+const char *device_type_name (int type)
+  {
+  if (type < 0 || type > DEVICE_MOUSE) return "unknown";
+  return device_type_names[type];
+  }
+
+/*======================================================================
+  key_name
+  Get the name of a scan code, such as KEY_A, or NULL if it has none
+======================================================================*/
+const char *key_name (int code)
+  {
+  for (const KeyName *k = keynames; k->name; k++)
+    if (k->code == code) return k->name;
+  return NULL;
+  }
@@ -0,0 +1,211 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  mapping.h
+
+  The mapping image is the dispatch table that associates GPIO pins
+    with keystrokes. It is a single, position-independent block of
+    memory, so it can be written to disk as it is, and later mmap()ed
+    and used directly, without any parsing or copying. All the
+    references within the image are byte offsets from its start.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/input.h>
+#include "defs.h"
+
+#define MAP_IMAGE_MAGIC "PBKM"
+
+// Increase MAP_IMAGE_VERSION whenever the layout of the image changes,
+//   so that stale cache files get rebuilt rather than misinterpreted
+#define MAP_IMAGE_VERSION 8
+
+// This is the format of the built-in mapping table. Each GPIO pin is
+//   associated with an array of steps, terminated by END.
+typedef struct _Mapping
+  {
+  int pin;
+  const Step *steps;
+  } Mapping;
+
+// MAX_DEVICES is the largest number of uinput devices we will create
+#define MAX_DEVICES 8
+
+// The kinds of device we can create. They differ in how they identify
+//   themselves to the system, so that desktops and games treat them
+//   appropriately; each only advertises the keys and buttons that are
+//   actually mapped to it.
+typedef enum
+  {
+  DEVICE_KEYBOARD = 0,
+  DEVICE_CONSUMER,        // Media and volume keys, like a remote control
+  DEVICE_GAMEPAD,
+  DEVICE_MOUSE
+  } DeviceType;
+
+// MAX_AXES is the largest number of absolute axes, across all devices
+#define MAX_AXES 16
+
+// Pointer speeds and acceleration are fixed-point numbers, with 16 bits
+//   after the binary point, so the output thread never needs floating
+//   point. MAP_FIXED_ONE is 1.0.
+#define MAP_FIXED_ONE 65536
+
+// How a nudge speeds up while its button is held -- see MapEntry
+typedef enum
+  {
+  ACCEL_LINEAR = 0,
+  ACCEL_QUADRATIC         // Gentle at first, for fine positioning
+  } AccelCurve;
+
+// How urgent a mapping is. Urgent macros jump ahead of normal ones,
+//   and a cancelling macro also discards the normal ones, releasing 
+//   any keys they were holding, before it plays.
+typedef enum
+  {
+  PRIORITY_NORMAL = 0,
+  PRIORITY_URGENT,
+  PRIORITY_CANCEL
+  } Priority;
+
+// A uinput device to create, with the event types and key codes used 
+//   in the macros that are sent to it, one bit each, so it can be set 
+//   up without scanning all the events
+typedef struct _MapDevice
+  {
+  char name[64];          // Name given to uinput, and used in the config
+  uint32_t type;          // See DeviceType
+  uint32_t evbits;
+  uint32_t relbits;       // Relative axes, like REL_X, one bit each
+  uint32_t pace_usec;     // Least time between reports, or 0 for no limit
+  uint8_t keybits[(KEY_CNT + 7) / 8];
+  } MapDevice;
+
+// The image starts with this header...
+typedef struct _MapImage
+  {
+  char magic[4];
+  uint32_t version;
+  uint32_t size;          // Total size of the image, including this header
+  uint32_t checksum;      // FNV-1a hash of everything after this
+  int64_t source_mtime;   // Modification time of the config file, in ns...
+  int64_t source_size;    // ...and its size, so we can tell if it is stale
+  uint32_t event_size;    // sizeof (struct input_event) where it was built
+  uint32_t nentries;
+  uint32_t entries_off;
+  uint32_t nruns;
+  uint32_t runs_off;
+  uint32_t nevents;
+  uint32_t events_off;
+  uint32_t ndevices;
+  MapDevice devices[MAX_DEVICES];
+  uint32_t frame_usec;    // How often pointer motion and axes are updated
+  uint32_t naxes;
+  uint32_t axes_off;
+  } MapImage;
+
+// ...followed by one entry per pin. Each pin's mapping is a macro,
+//   made up of one or more runs. A pin can also nudge the pointer: 
+//   while its button is held, the pointer moves by nudge_x and nudge_y
+//   every frame, speeding up to accel_max times that over 
+//   accel_ramp_usec...
+typedef struct _MapEntry
+  {
+  int32_t pin;
+  uint32_t first_run;     // Index into the run array
+  uint32_t nruns;
+  uint32_t device;        // Index into the device array
+  int32_t nudge_x;        // Pointer movement per frame, at first
+  int32_t nudge_y;
+  uint32_t accel_ramp_usec;
+  uint32_t accel_max;     // Fixed point -- see MAP_FIXED_ONE
+  uint32_t accel_curve;   // See AccelCurve
+  uint32_t pace_usec;     // Least time between reports, or 0 for no limit
+  uint32_t priority;      // See Priority
+  } MapEntry;
+
+// ...then the absolute axes, each of which is driven by a number read
+//   from a file, like an IIO analog input in sysfs, and scaled from the
+//   input range to the output range...
+typedef struct _MapAxis
+  {
+  uint32_t device;
+  uint32_t code;          // ABS_X, etc
+  int32_t in_min;
+  int32_t in_max;
+  int32_t out_min;
+  int32_t out_max;
+  char path[104];
+  } MapAxis;
+
+// ...where a run is a sequence of input events that are output
+//   together, followed by a pause before the next run. A macro without
+//   delays is a single run...
+typedef struct _MapRun
+  {
+  uint32_t first_event;   // Index into the event array
+  uint32_t nevents;
+  uint32_t delay_usec;    // Pause after this run
+  } MapRun;
+
+// ...and then the events themselves, ready to write to uinput. Repeats
+//   and holds in the config file are all expanded when the image is
+//   built.
+
+static inline const MapEntry *mapimage_entry (const MapImage *image, int i)
+  {
+  return (const MapEntry *)((const char *)image + image->entries_off) + i;
+  }
+
+static inline const MapAxis *mapimage_axis (const MapImage *image, int i)
+  {
+  return (const MapAxis *)((const char *)image + image->axes_off) + i;
+  }
+
+static inline BOOL mapentry_has_nudge (const MapEntry *entry)
+  {
+  return entry->nudge_x != 0 || entry->nudge_y != 0;
+  }
+
+static inline const MapRun *mapimage_runs (const MapImage *image,
+    const MapEntry *entry)
+  {
+  return (const MapRun *)((const char *)image + image->runs_off)
+    + entry->first_run;
+  }
+
+static inline const struct input_event *mapimage_events
+    (const MapImage *image, const MapRun *run)
+  {
+  return (const struct input_event *)((const char *)image
+    + image->events_off) + run->first_event;
+  }
+
+MapImage *mapimage_from_table (const Mapping *mappings);
+MapImage *mapimage_from_config (const char *filename);
+const MapImage *mapimage_map (const char *filename);
+BOOL mapimage_is_current (const MapImage *image, const char *config);
+BOOL mapimage_write (const MapImage *image, const char *filename);
+void mapimage_release (const MapImage *image);
+void mapimage_write_c (const MapImage *image, const char *filename,
+       const char *source);
+const MapEntry *mapimage_find_pin (const MapImage *image, int pin);
+
+static inline BOOL mapdevice_has_key (const MapDevice *device, int code)
+  {
+  return (device->keybits[code / 8] >> (code % 8)) & 1;
+  }
+
+const char *device_type_name (int type);
+const char *key_name (int code);
+
+// In builds with FIXED_MAPPINGS defined, these are provided by a source
+//   file generated by mapimage_write_c(), and the image is compiled in
+const MapImage *fixed_image (void);
+const MapEntry *fixed_find_pin (int pin);
@@ -0,0 +1,367 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  metrics.c
+
+  The Prometheus metrics file -- see metrics.h. Everything is read from
+    the counters and histograms that the other threads keep anyway, so
+    writing the file costs them nothing.
+
+  The thread also watches for the system clock being set, with a
+    timerfd that the kernel cancels when that happens. A Pi without a
+    real-time clock starts in 1970, and jumps decades when NTP sets
+    it; the debouncing uses the monotonic clock, so it isn't upset by
+    this, but a panel whose clock keeps jumping is worth knowing
+    about.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "metrics.h"
+#include "output.h"
+
+#define PREFIX "pi_button_to_kbd_"
+
+// The latest time a timer can be set to, so that it never expires
+#define TIME_T_MAX ((time_t)((1ULL << (sizeof (time_t) * 8 - 1)) - 1))
+
+static const MapImage *image = NULL;
+static const PinStats *pin_stats = NULL;
+static const LoopStats *loop_stats = NULL;
+static const char *metrics_path = NULL;
+static char temp_path[PATH_MAX];
+static int interval = METRICS_DEFAULT_INTERVAL;
+static int stop_fd = -1;
+static int clock_set_fd = -1;
+static pthread_t metrics_thread;
+static BOOL failing = FALSE;
+
+// Only the metrics thread uses these
+static uint64_t clock_steps = 0;
+static uint64_t last_nsec = 0;
+static uint64_t last_wakeups[2];
+
+// The main loop's counters for each pin
+typedef struct _PinMetric
+  {
+  const char *name;
+  const char *help;
+  size_t offset;
+  } PinMetric;
+
+static const PinMetric pin_metrics[] =
+  {
+  {"edges_total", "Times the main loop woke up for an edge on the pin",
+    offsetof (PinStats, edges)},
+  {"bounces_total", "Edges ignored during the bounce lock-out",
+    offsetof (PinStats, bounces)},
+  {"presses_total", "Edges accepted as presses",
+    offsetof (PinStats, presses)},
+  {"releases_total", "Edges accepted as releases",
+    offsetof (PinStats, releases)},
+  {"rejected_total", "Edges whose level had gone back when it was read",
+    offsetof (PinStats, rejected)},
+  {"read_errors_total", "Times the pin could not be read",
+    offsetof (PinStats, read_errors)},
+  {NULL, NULL, 0}
+  };
+
+/*======================================================================
+  write_family
+  Write the HELP and TYPE lines for a metric
+======================================================================*/
+static void write_family (FILE *f, const char *name, const char *type,
+    const char *help)
+  {
+  fprintf (f, "# HELP " PREFIX "%s %s.\n", name, help);
+  fprintf (f, "# TYPE " PREFIX "%s %s\n", name, type);
+  }
+
+/*======================================================================
+  write_counter
+  Write a counter with no labels
+======================================================================*/
+static void write_counter (FILE *f, const char *name, const char *help,
+    uint64_t value)
+  {
+  write_family (f, name, "counter", help);
+  fprintf (f, PREFIX "%s %llu\n", name, (unsigned long long)value);
+  }
+
+/*======================================================================
+  write_summary
+  Write the quantiles, sum and count of a histogram, in seconds, as
+    one 'stage' of the latency summary
+======================================================================*/
+static void write_summary (FILE *f, const char *stage, const Histogram *h)
+  {
+  static const int per_mille[] = {500, 900, 990, 999};
+  Histogram copy;
+  hist_snapshot (h, &copy);
+  for (int i = 0; i < sizeof (per_mille) / sizeof (int); i++)
+    fprintf (f, PREFIX "latency_seconds{stage=\"%s\",quantile=\"%g\"} "
+      "%.9f\n", stage, per_mille[i] / 1000.0,
+      hist_percentile (&copy, per_mille[i]) / 1e9);
+  fprintf (f, PREFIX "latency_seconds_sum{stage=\"%s\"} %.9f\n", stage,
+    copy.total / 1e9);
+  fprintf (f, PREFIX "latency_seconds_count{stage=\"%s\"} %llu\n", stage,
+    (unsigned long long)copy.count);
+  }
+
+/*======================================================================
+  write_metrics
+  Write all the metrics, at monotonic time 'now'. The rates are over
+    the time since the last time they were written.
+======================================================================*/
+static void write_metrics (FILE *f, uint64_t now)
+  {
+  for (const PinMetric *m = pin_metrics; m->name; m++)
+    {
+    write_family (f, m->name, "counter", m->help);
+    for (int i = 0; i < image->nentries; i++)
+      {
+      const Counter *c =
+        (const Counter *)((const char *)&pin_stats[i] + m->offset);
+      fprintf (f, PREFIX "%s{pin=\"%d\"} %llu\n", m->name,
+        mapimage_entry (image, i)->pin, (unsigned long long)counter_get (c));
+      }
+    }
+
+  const RingStats *ring = output_get_ring_stats();
+  const OutputStats *out = output_get_stats();
+  write_counter (f, "ring_full_total",
+    "Presses dropped because the output thread was not keeping up",
+    counter_get (&ring->full));
+  write_counter (f, "queue_dropped_total",
+    "Queued macros discarded to make room, with --overflow=drop-oldest",
+    counter_get (&out->dropped));
+  write_counter (f, "queue_coalesced_total",
+    "Presses merged with a queued one, with --overflow=coalesce",
+    counter_get (&out->coalesced));
+  write_counter (f, "queue_blocked_total",
+    "Times a press had to wait for room in the queue",
+    counter_get (&out->blocked));
+  write_counter (f, "cancelled_total",
+    "Queued macros abandoned for a cancelling one",
+    counter_get (&out->cancelled));
+  write_counter (f, "output_events_total", "Input events written",
+    counter_get (&out->events));
+  write_counter (f, "output_busy_total",
+    "Times the output device could not take any more events",
+    counter_get (&out->device_busy));
+  write_counter (f, "output_errors_total",
+    "Batches of events abandoned after an error or timeout",
+    counter_get (&out->errors));
+  write_counter (f, "clock_steps_total",
+    "Times the system clock was set, rather than slewed",
+    clock_steps);
+
+  uint64_t wakeups[2] = {counter_get (&loop_stats->wakeups),
+    counter_get (&out->wakeups)};
+  static const char *threads[2] = {"main", "output"};
+  write_family (f, "wakeups_total", "counter",
+    "Times each thread woke up");
+  for (int i = 0; i < 2; i++)
+    fprintf (f, PREFIX "wakeups_total{thread=\"%s\"} %llu\n", threads[i],
+      (unsigned long long)wakeups[i]);
+  write_family (f, "wakeups_per_second", "gauge",
+    "Wake-ups per second of each thread, since the file was last written");
+  for (int i = 0; i < 2; i++)
+    {
+    double rate = now > last_nsec
+      ? (wakeups[i] - last_wakeups[i]) * 1e9 / (now - last_nsec) : 0.0;
+    fprintf (f, PREFIX "wakeups_per_second{thread=\"%s\"} %.3f\n",
+      threads[i], rate);
+    last_wakeups[i] = wakeups[i];
+    }
+  last_nsec = now;
+
+  write_family (f, "queued_macros", "gauge",
+    "Macros waiting in each lane of the output queue");
+  fprintf (f, PREFIX "queued_macros{lane=\"normal\"} %llu\n",
+    (unsigned long long)counter_get (&out->queued[0]));
+  fprintf (f, PREFIX "queued_macros{lane=\"urgent\"} %llu\n",
+    (unsigned long long)counter_get (&out->queued[1]));
+
+  write_family (f, "latency_seconds", "summary",
+    "Latency of each stage, from GPIO edge to output");
+  write_summary (f, "edge_to_accept", &ring->accept);
+  write_summary (f, "accept_to_emit", &out->accept_to_emit);
+  write_summary (f, "emit_duration", &out->emit_duration);
+  write_summary (f, "edge_to_output", &out->latency);
+  }
+
+/*======================================================================
+  write_file
+  Write the metrics to the temporary file, and rename it over the real
+    one. Returns FALSE, with errno set, on failure.
+======================================================================*/
+static BOOL write_file (void)
+  {
+  FILE *f = fopen (temp_path, "w");
+  if (!f) return FALSE;
+  write_metrics (f, mono_nsec());
+  if (ferror (f))
+    {
+    int e = errno;
+    fclose (f);
+    unlink (temp_path);
+    errno = e;
+    return FALSE;
+    }
+  if (fclose (f) != 0 || rename (temp_path, metrics_path) != 0)
+    {
+    int e = errno;
+    unlink (temp_path);
+    errno = e;
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+/*======================================================================
+  update
+  Write the file, reporting failures only when they start, so that a
+    full disk doesn't fill the log as well
+======================================================================*/
+static void update (void)
+  {
+  if (write_file())
+    failing = FALSE;
+  else if (!failing)
+    {
+    fprintf (stderr, "Can't write %s: %s\n", metrics_path,
+      strerror (errno));
+    failing = TRUE;
+    }
+  }
+
+/*======================================================================
+  watch_clock
+  Arm the timerfd that is cancelled if the system clock is set
+======================================================================*/
+static void watch_clock (void)
+  {
+  struct itimerspec its;
+  memset (&its, 0, sizeof (its));
+  its.it_value.tv_sec = TIME_T_MAX;
+  timerfd_settime (clock_set_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+    &its, NULL);
+  }
+
+/*======================================================================
+  metrics_thread_main
+======================================================================*/
+static void *metrics_thread_main (void *arg)
+  {
+  uint64_t next = mono_nsec() + interval * 1000000000ULL;
+  for (;;)
+    {
+    uint64_t now = mono_nsec();
+    if (now >= next)
+      {
+      update();
+      next += interval * 1000000000ULL;
+      if (next <= now) next = now + interval * 1000000000ULL;
+      continue;
+      }
+    struct pollfd pfd[2] = {{stop_fd, POLLIN, 0},
+      {clock_set_fd, POLLIN, 0}};
+    int timeout = (next - now + 999999) / 1000000;
+    if (poll (pfd, 2, timeout) < 0 && errno != EINTR) break;
+    if (pfd[0].revents & POLLIN) break;
+    if (pfd[1].revents & POLLIN)
+      {
+      uint64_t count;
+      if (read (clock_set_fd, &count, sizeof (count)) < 0
+           && errno == ECANCELED)
+        {
+        dbglog ("System clock has been set\n");
+        clock_steps++;
+        }
+      watch_clock();
+      }
+    }
+  return NULL;
+  }
+
+/*======================================================================
+  metrics_start
+  Start writing the metrics to 'path' every 'interval' seconds. 'pins'
+    and 'loop' are the main loop's counters, as for stats_start(). The
+    file is written once straight away, so that a bad path is found
+    at once; any failure to start is fatal.
+======================================================================*/
+void metrics_start (const char *path, int _interval, const MapImage *_image,
+    const PinStats *pins, const LoopStats *loop)
+  {
+  image = _image;
+  pin_stats = pins;
+  loop_stats = loop;
+  metrics_path = path;
+  interval = _interval > 0 ? _interval : METRICS_DEFAULT_INTERVAL;
+  // The collector ignores files that don't end in .prom, so this is
+  //   never read
+  if (snprintf (temp_path, sizeof (temp_path), "%s.tmp", path)
+       >= sizeof (temp_path))
+    {
+    fprintf (stderr, "Metrics path too long: %s\n", path);
+    exit (-1);
+    }
+  last_nsec = mono_nsec();
+  if (!write_file())
+    {
+    fprintf (stderr, "Can't write %s: %s\n", path, strerror (errno));
+    exit (-1);
+    }
+
+  stop_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  clock_set_fd = timerfd_create (CLOCK_REALTIME,
+    TFD_NONBLOCK | TFD_CLOEXEC);
+  if (stop_fd < 0 || clock_set_fd < 0)
+    {
+    fprintf (stderr, "Can't start metrics thread: %s\n", strerror (errno));
+    exit (-1);
+    }
+  watch_clock();
+  sigset_t all, old;
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  if (pthread_create (&metrics_thread, NULL, metrics_thread_main, NULL))
+    {
+    fprintf (stderr, "Can't start metrics thread: %s\n", strerror (errno));
+    exit (-1);
+    }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  dbglog ("Writing metrics to %s every %d s\n", path, interval);
+  }
+
+/*======================================================================
+  metrics_stop
+  Stop the thread, and write the file one last time
+======================================================================*/
+void metrics_stop (void)
+  {
+  if (stop_fd < 0) return;
+  uint64_t one = 1;
+  write (stop_fd, &one, sizeof (one));
+  pthread_join (metrics_thread, NULL);
+  close (stop_fd);
+  close (clock_set_fd);
+  stop_fd = -1;
+  update();
+  }
@@ -0,0 +1,30 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  metrics.h
+
+  A metrics file for the Prometheus node_exporter's textfile collector.
+    With --metrics=FILE, a thread of its own writes the counters and
+    latency percentiles to FILE every --metrics-interval seconds, in
+    the Prometheus text format. Each time, the file is written under
+    another name and renamed over the old one, so the collector never
+    sees half a file. FILE must end in '.prom', and be in the
+    collector's directory; for example:
+
+    --metrics=/var/lib/node_exporter/textfile_collector/buttons.prom
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#pragma once
+
+#include "defs.h"
+#include "mapping.h"
+#include "stats.h"
+
+#define METRICS_DEFAULT_INTERVAL 15
+
+void metrics_start (const char *path, int interval, const MapImage *image,
+       const PinStats *pins, const LoopStats *loop);
+void metrics_stop (void);
@@ -0,0 +1,1299 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  output.c
+
+  Functions for sending events to the output devices, and for playing
+    macros. Where the events end up depends on the sink -- see sink.h.
+
+  A macro is a list of runs of events, with a pause after each run.
+    When a button is pressed, its macro is added to a queue. 
+    output_run() outputs any runs that are due, and says how long 
+    it is until the next one. Macros are played one at a time, in the 
+    order their buttons were pressed, so that the keystrokes from 
+    different macros don't get mixed up.
+
+  Urgent macros -- see Priority -- go in a separate lane, which always
+    plays first. An urgent macro starts as soon as the current run or 
+    report of a normal macro has been output -- or, for a long run, the
+    batch of it being written -- and the normal macro carries on after
+    it. A cancelling macro also throws away everything
+    in the normal lane, and releases the keys that the macro that was
+    playing had pressed. Each lane has its own ring buffer from the
+    main loop, so an urgent press never waits behind normal ones that
+    can't be queued yet.
+
+  A macro or a device can be paced, for programs that lose keystrokes
+    that arrive too quickly. Then each report (a group of events ending
+    with SYN_REPORT) is output on its own, and the next one is due a 
+    fixed time later. As with pauses, the time is measured from when 
+    the last report was due, rather than when it was actually output, 
+    so the timing doesn't drift. The output thread sleeps until the 
+    absolute time that the next report is due, on the program's clock,
+    which is virtual when a recording is being replayed.
+
+  The output devices are non-blocking. If one can't take any more events,
+    the batch being written is kept, and finished when the device is
+    writable again; no further runs are started until it has been.
+    So a batch is never partly lost, which could leave a key stuck
+    down. Meanwhile, new button presses back up in the macro queue,
+    and what happens when that is full depends on the overflow policy.
+    Under OVERFLOW_BLOCK they wait in the ring buffer until there is
+    room. Under OVERFLOW_DROP_OLDEST, the oldest macro that hasn't 
+    started yet is discarded to make room. Under OVERFLOW_COALESCE, a
+    press is discarded if the same macro is already waiting to start.
+    Only macros that release every key they press are ever discarded,
+    so a press is never separated from its release.
+
+  Pointer nudges and absolute axes are updated once per frame, while
+    any nudge button is held, or all the time if there are axes. All
+    the movement for a device in a frame goes in a single report. The
+    speed of a nudge is worked out in fixed point -- see MAP_FIXED_ONE --
+    and the fractions of a pixel are carried over to the next frame,
+    so slow speeds and gentle acceleration work properly.
+
+  All this happens in a separate output thread, so a long macro, or
+    a write to uinput that blocks, never holds up the GPIO processing
+    in the main loop. The main loop passes button presses to the output
+    thread through a single-producer, single-consumer ring buffer, 
+    which needs no locks. The output thread sleeps on an eventfd when
+    it has nothing to do, and the main loop only writes to the eventfd
+    if the output thread is actually asleep.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include "output.h"
+#include "clock.h"
+#include "trace.h"
+#include "usdt.h"
+#include "sink.h"
+#include "probe.h"
+
+// A macro that is queued or playing
+typedef struct _Playing
+  {
+  const MapEntry *entry;
+  int next_run;
+  int next_event;     // Within the run, when the macro is paced
+  uint64_t edge_time; // Monotonic time of the GPIO edge that started it
+  uint64_t decided;   // ...and of when the main loop passed it on
+  } Playing;
+
+// A lane of macros with the same priority. The queue is a circular 
+//   buffer of macros; the one at the head is the one currently playing.
+typedef struct _Lane
+  {
+  Playing queue[MAX_QUEUED_MACROS];
+  int head;
+  int len;
+  uint64_t next_due;  // When the next run of the head macro is due
+  // The keys held down by the macros in this lane, on each device, so
+  //   they can be released if the lane is cancelled
+  uint8_t keys_down[MAX_DEVICES][(KEY_CNT + 7) / 8];
+  } Lane;
+
+#define LANE_NORMAL 0
+#define LANE_URGENT 1
+#define NUM_LANES 2
+
+// The output state
+static const Sink *sink = NULL;
+static const int *device_fds = NULL; // Indexed like the image's devices
+static const MapImage *image = NULL;
+static Lane lanes[NUM_LANES];
+// Set when the normal lane has been cancelled, until its keys have
+//   been released
+static BOOL release_pending = FALSE;
+// The edge time of the last cancelling press. Normal presses before 
+//   this that are still in the ring are discarded.
+static uint64_t cancel_time = 0;
+// The earliest time each device can take another report, if it is paced
+static uint64_t device_next[MAX_DEVICES];
+
+// The runs that are due to be output are copied into a batch, so 
+//   that they can all be written at once. Usually this is a single run, 
+//   but if several macros with no pauses are queued, they all go 
+//   together, as long as they are for the same device. The copy gets 
+//   the timestamps filled in. We also keep the edge times of the macros
+//   that start in this batch, to measure the time from edge to output.
+static struct input_event batch[OUTPUT_BATCH_EVENTS];
+static int batch_len = 0;
+static size_t batch_written = 0; // Bytes of the batch already written
+static int batch_device = -1;    // Where the batch is going...
+static int batch_fd = -1;        // ...and its descriptor
+// The batch as it is written, after the sink has encoded it
+static const char *batch_out = NULL;
+static size_t batch_out_len = 0;
+static char encoded[OUTPUT_BATCH_EVENTS * SINK_MAX_EVENT_BYTES];
+static uint64_t batch_edges[MAX_QUEUED_MACROS * NUM_LANES];
+static uint64_t batch_decided[MAX_QUEUED_MACROS * NUM_LANES];
+static int batch_nedges = 0;
+// Whether the latency probe is running, and the time the batch's first
+//   write started
+static BOOL probing = FALSE;
+static uint64_t batch_write_start = 0;
+
+static OutputStats stats;
+static OverflowPolicy overflow_policy = OVERFLOW_BLOCK;
+
+// A button press or release, passed from the main loop to the output 
+//   thread
+typedef struct _OutputRequest
+  {
+  const MapEntry *entry;
+  BOOL pressed;
+  uint64_t edge_time;
+  uint64_t decided;
+  } OutputRequest;
+
+// The state of a nudge, indexed like the image's entries
+typedef struct _Nudge
+  {
+  BOOL active;
+  uint64_t start;         // When the button was pressed
+  int32_t frac_x;         // Fraction of a pixel left over, fixed point
+  int32_t frac_y;
+  } Nudge;
+
+static Nudge nudges[MAX_PINS];
+static int nudges_active = 0;
+static int axis_fds[MAX_AXES];
+static int32_t axis_values[MAX_AXES]; // Last value sent for each axis
+static uint64_t next_frame = 0;
+static int frame_device = 0;  // Where a frame that had to wait got to
+
+// A ring buffer, one for each lane. 'tail' is only written by the main
+//   loop, and 'head' only by the output thread. They are free-running 
+//   counters, so the number of requests in the ring is just 
+//   tail - head. They are kept in separate cache lines, so the two 
+//   threads don't fight over them.
+#define RING_MASK (OUTPUT_RING_SIZE - 1)
+typedef struct _Ring
+  {
+  OutputRequest slots[OUTPUT_RING_SIZE];
+  _Atomic unsigned head __attribute__((aligned(64)));
+  _Atomic unsigned tail __attribute__((aligned(64)));
+  } Ring;
+
+static Ring rings[NUM_LANES];
+
+// Ring statistics, only written by the main loop
+static RingStats ring_stats;
+// When dropped presses were last reported, and how many had been dropped
+//   by then. A ring that stays full is reported at most this often.
+#define RING_FULL_REPORT_NSEC 1000000000ULL
+static uint64_t full_reported_time = 0;
+static uint64_t full_reported = 0;
+// The nudges whose presses have been passed on, but not yet their 
+//   releases, by entry, and how many there are in each lane. Only used 
+//   by the main loop.
+static BOOL release_owed[MAX_PINS];
+static int releases_owed[NUM_LANES];
+
+// The output thread's state
+static pthread_t output_thread;
+static int wake_fd = -1;
+static atomic_int thread_sleeping = 0;
+static atomic_int thread_stop = 0;
+// Set by the output thread while it has macros to play
+static atomic_int thread_working = 0;
+// The tail of each ring, as the output thread last saw it before it 
+//   went to sleep, for output_settled(). It can't match until the
+//   thread has been to sleep once.
+static _Atomic unsigned seen_tail[NUM_LANES] = {~0u, ~0u};
+
+static BOOL flush_batch (void);
+static void drain_batch (void);
+static const OutputRequest *ring_peek (Ring *r);
+
+/*======================================================================
+  batch_event
+  Add a single event to the batch, stamped with the specified time. The
+    caller makes sure there is room for it.
+======================================================================*/
+static void batch_event (int type, int code, int value, uint64_t stamp)
+  {
+  if (probing) stamp = 0;
+  struct input_event *ie = &batch[batch_len++];
+  ie->type = type;
+  ie->code = code;
+  ie->value = value;
+  ie->input_event_sec = stamp / 1000000000;
+  ie->input_event_usec = (stamp % 1000000000) / 1000;
+  }
+
+/*======================================================================
+  batch_room
+  Make sure there is room for 'n' more events in the batch, writing it
+    first if there isn't. Returns FALSE if the device is busy; whatever
+    hasn't been written is kept, as it is by flush_batch().
+======================================================================*/
+static BOOL batch_room (int n)
+  {
+  if (batch_len + n <= OUTPUT_BATCH_EVENTS) return TRUE;
+  return flush_batch();
+  }
+
+/*======================================================================
+  release_batch
+  Replace the batch with a release of every key that it mentions, or
+    that a lane is holding down on its device, and a SYN. This is only
+    for when the device has stopped taking events, and the batch has to
+    be abandoned: whatever state it was left in, no key is left down.
+======================================================================*/
+static void release_batch (void)
+  {
+  uint8_t down[(KEY_CNT + 7) / 8];
+  memset (down, 0, sizeof (down));
+  for (int i = 0; i < batch_len; i++)
+    {
+    int code = batch[i].code;
+    if (batch[i].type == EV_KEY) down[code / 8] |= 1 << (code % 8);
+    }
+  for (int lane = 0; lane < NUM_LANES; lane++)
+    for (int i = 0; i < sizeof (down); i++)
+      down[i] |= lanes[lane].keys_down[batch_device][i];
+  batch_len = 0;
+  batch_written = 0;
+  batch_out = NULL;
+  batch_nedges = 0;
+  uint64_t now = clock_now();
+  for (int code = 0; code < KEY_CNT; code++)
+    {
+    if (!((down[code / 8] >> (code % 8)) & 1)) continue;
+    if (batch_len == OUTPUT_BATCH_EVENTS - 1) break;
+    batch_event (EV_KEY, code, 0, now);
+    }
+  batch_event (EV_SYN, SYN_REPORT, 0, now);
+  }
+
+/*======================================================================
+  drain_batch
+  Write whatever is left of the batch when the thread stops, waiting 
+    for the device if it is busy, but only for OUTPUT_TIMEOUT_MSEC at 
+    a time. If the device stops taking events, the batch is replaced
+    by releases of its keys, which get one more chance to be written.
+======================================================================*/
+static void drain_batch (void)
+  {
+  BOOL releasing = FALSE;
+  while (!flush_batch())
+    {
+    struct pollfd pfd = {batch_fd, POLLOUT, 0};
+    if (poll (&pfd, 1, OUTPUT_TIMEOUT_MSEC) > 0) continue;
+    if (!releasing)
+      fprintf (stderr, "Output device is not accepting events\n");
+    counter_add (&stats.errors, 1);
+    if (releasing)
+      {
+      batch_len = 0;
+      batch_written = 0;
+      batch_out = NULL;
+      return;
+      }
+    release_batch();
+    releasing = TRUE;
+    }
+  }
+
+/*======================================================================
+  batch_run
+  Add part of a run of a macro, from event 'first' up to but not 
+    including 'end', to the batch of events that will be written by
+    flush_batch(), stamped with the specified monotonic time. Only as
+    much as fits in the batch is added, and the event it stopped at is
+    returned. Recent
+    kernels use the timestamp of an event written to uinput, if it is
+    within the last few seconds, so programs reading the events see 
+    when the button was actually pressed, not when we got round to 
+    writing the event. Older kernels just ignore it. A time of zero 
+    leaves the kernel to stamp the events itself, as it always does
+    while the latency probe is running.
+======================================================================*/
+static int batch_run (const MapRun *run, int first, int end, 
+    uint64_t stamp)
+  {
+  if (probing) stamp = 0;
+  const struct input_event *events = mapimage_events (image, run);
+  int i;
+  for (i = first; i < end && batch_len < OUTPUT_BATCH_EVENTS; i++)
+    {
+    struct input_event *ie = &batch[batch_len++];
+    *ie = events[i];
+    ie->input_event_sec = stamp / 1000000000;
+    ie->input_event_usec = (stamp % 1000000000) / 1000;
+    }
+  return i;
+  }
+
+/*======================================================================
+  set_batch_device
+  Make the batch go to a different device. Returns FALSE if the batch
+    already has events for another device, which couldn't be written.
+======================================================================*/
+static BOOL set_batch_device (int device)
+  {
+  if (device == batch_device) return TRUE;
+  if (!flush_batch()) return FALSE;
+  batch_device = device;
+  batch_fd = device_fds[device];
+  return TRUE;
+  }
+
+/*======================================================================
+  flush_batch
+  Write all the events in the batch with one system call, and update
+    the latency figures for the macros that started in it. The sink
+    encodes the batch first, if it needs to. If the device is busy, 
+    whatever hasn't been written is kept for next time, and we return 
+    FALSE.
+======================================================================*/
+static BOOL flush_batch (void)
+  {
+  if (batch_len == 0) return TRUE;
+  if (!batch_out)
+    {
+    if (sink->encode)
+      {
+      batch_out_len = sink->encode (batch_device, batch, batch_len, 
+        encoded);
+      batch_out = encoded;
+      }
+    else
+      {
+      batch_out_len = batch_len * sizeof (struct input_event);
+      batch_out = (const char *)batch;
+      }
+    batch_write_start = clock_now();
+    USDT2 (write_begin, batch_device, batch_len);
+    }
+  BOOL ok = TRUE;
+  while (batch_written < batch_out_len)
+    {
+    ssize_t n = write (batch_fd, batch_out + batch_written, 
+      batch_out_len - batch_written);
+    if (n < 0)
+      {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) 
+        {
+        counter_add (&stats.device_busy, 1);
+        trace (TRACE_OUTPUT, clock_now(), TRACE_DEVICE_BUSY, batch_device,
+          0, 0);
+        return FALSE;
+        }
+      // Nothing sensible can be done with the rest of the batch
+      fprintf (stderr, "Can't write events: %s\n", strerror (errno));
+      counter_add (&stats.errors, 1);
+      ok = FALSE;
+      break;
+      }
+    batch_written += n;
+    counter_add (&stats.writes, 1);
+    }
+  counter_add (&stats.events, batch_len);
+  dbglog ("Emit %d event(s)\n", batch_len);
+  if (probing) 
+    probe_batch (batch_device, batch_edges, batch_decided, batch_nedges,
+      batch_write_start);
+  uint64_t now = clock_now();
+  USDT4 (write_end, batch_device, batch_len, now - batch_write_start, ok);
+  for (int i = 0; i < batch_len; i++)
+    {
+    if (batch[i].type == EV_SYN) continue;
+    trace (TRACE_OUTPUT, now, TRACE_EMIT + batch[i].type, batch_device,
+      batch[i].code, batch[i].value);
+    }
+  batch_len = 0;
+  batch_written = 0;
+  batch_out = NULL;
+
+  hist_record (&stats.emit_duration, now - batch_write_start);
+  for (int i = 0; i < batch_nedges; i++)
+    {
+    if (batch_edges[i] == 0) continue;
+    uint64_t latency = now - batch_edges[i];
+    dbglog ("Edge to emit: %llu us\n", (unsigned long long)latency / 1000);
+    hist_record (&stats.latency, latency);
+    hist_record (&stats.accept_to_emit, 
+      batch_write_start - batch_decided[i]);
+    }
+  batch_nedges = 0;
+  return TRUE;
+  }
+
+/*======================================================================
+  output_get_stats
+  Get the output statistics: the time from GPIO edge to writing the 
+    first events of the macro, and what happened when things backed up
+======================================================================*/
+const OutputStats *output_get_stats (void)
+  {
+  return &stats;
+  }
+
+/*======================================================================
+  output_init
+======================================================================*/
+void output_init (const Sink *_sink, const int *fds, 
+    const MapImage *_image)
+  {
+  sink = _sink;
+  device_fds = fds;
+  image = _image;
+  for (int i = 0; i < image->naxes; i++)
+    {
+    const MapAxis *a = mapimage_axis (image, i);
+    axis_fds[i] = open (a->path, O_RDONLY);
+    if (axis_fds[i] < 0)
+      {
+      fprintf (stderr, "Can't open %s: %s\n", a->path, strerror (errno));
+      exit (-1);
+      }
+    // Make sure the first reading is sent, whatever it is
+    axis_values[i] = INT32_MIN;
+    }
+  }
+
+/*======================================================================
+  output_set_overflow
+  Set what output_start_macro() does when the macro queue is full
+======================================================================*/
+void output_set_overflow (OverflowPolicy policy)
+  {
+  overflow_policy = policy;
+  }
+
+/*======================================================================
+  output_set_probe
+  Turn the latency probe on or off. The probe has to have been opened
+    first. While it is on, events are stamped by the kernel, rather 
+    than with the time of the GPIO edge, so that the probe can see when
+    they were delivered.
+======================================================================*/
+void output_set_probe (BOOL on)
+  {
+  probing = on;
+  }
+
+/*======================================================================
+  output_overflow_from_name
+  Get the overflow policy with a name given on the command line, or
+    -1 if there isn't one
+======================================================================*/
+int output_overflow_from_name (const char *name)
+  {
+  if (strcmp (name, "block") == 0) return OVERFLOW_BLOCK;
+  if (strcmp (name, "drop-oldest") == 0) return OVERFLOW_DROP_OLDEST;
+  if (strcmp (name, "coalesce") == 0) return OVERFLOW_COALESCE;
+  return -1;
+  }
+
+/*======================================================================
+  is_balanced
+  Check whether a macro releases every key it presses. Only macros like
+    this can be discarded when the queue overflows. Discarding, say,
+    a macro that just releases SHIFT would leave SHIFT held down. This
+    is only used when the queue is full, so it needn't be fast.
+======================================================================*/
+static BOOL is_balanced (const MapEntry *entry)
+  {
+  const MapRun *runs = mapimage_runs (image, entry);
+  int held = 0;
+  for (int r = 0; r < entry->nruns; r++)
+    {
+    const struct input_event *events = mapimage_events (image, &runs[r]);
+    for (int i = 0; i < runs[r].nevents; i++)
+      {
+      if (events[i].type != EV_KEY) continue;
+      if (events[i].value == 1) held++;
+      else if (events[i].value == 0) held--;
+      }
+    }
+  return held == 0;
+  }
+
+/*======================================================================
+  has_started
+======================================================================*/
+static inline BOOL has_started (const Playing *p)
+  {
+  return p->next_run > 0 || p->next_event > 0;
+  }
+
+/*======================================================================
+  is_waiting
+  Check whether the macro for 'entry' is queued in a lane, but hasn't
+    started
+======================================================================*/
+static BOOL is_waiting (const Lane *l, const MapEntry *entry)
+  {
+  for (int i = 0; i < l->len; i++)
+    {
+    const Playing *p = &l->queue[(l->head + i) % MAX_QUEUED_MACROS];
+    if (p->entry == entry && !has_started (p)) return TRUE;
+    }
+  return FALSE;
+  }
+
+/*======================================================================
+  drop_oldest
+  Discard the oldest macro in a lane that hasn't started, and that
+    is safe to discard. Returns FALSE if there isn't one.
+======================================================================*/
+static BOOL drop_oldest (Lane *l)
+  {
+  for (int i = 0; i < l->len; i++)
+    {
+    const Playing *p = &l->queue[(l->head + i) % MAX_QUEUED_MACROS];
+    if (has_started (p) || !is_balanced (p->entry)) continue;
+    dbglog ("Queue full: dropping macro for pin %d\n", p->entry->pin);
+    trace (TRACE_OUTPUT, clock_now(), TRACE_DROP, 0, p->entry->pin, 0);
+    for (int j = i + 1; j < l->len; j++)
+      l->queue[(l->head + j - 1) % MAX_QUEUED_MACROS] 
+        = l->queue[(l->head + j) % MAX_QUEUED_MACROS];
+    l->len--;
+    counter_add (&stats.dropped, 1);
+    return TRUE;
+    }
+  return FALSE;
+  }
+
+/*======================================================================
+  lane_for
+  Get the lane that the macro for 'entry' is played in
+======================================================================*/
+static inline int lane_for (const MapEntry *entry)
+  {
+  return entry->priority == PRIORITY_NORMAL ? LANE_NORMAL : LANE_URGENT;
+  }
+
+/*======================================================================
+  cancel_normal
+  Throw away all the macros in the normal lane, including the one that
+    is playing. The keys it was holding down are released by the next
+    call to output_run().
+======================================================================*/
+static void cancel_normal (uint64_t edge_time)
+  {
+  Lane *l = &lanes[LANE_NORMAL];
+  if (l->len > 0) dbglog ("Cancelling %d macro(s)\n", l->len);
+  counter_add (&stats.cancelled, l->len);
+  if (l->len > 0) 
+    trace (TRACE_OUTPUT, clock_now(), TRACE_CANCEL, 0, 0, l->len);
+  l->len = 0;
+  l->next_due = 0;
+  release_pending = TRUE;
+  if (edge_time > cancel_time) cancel_time = edge_time;
+  }
+
+/*======================================================================
+  output_start_macro
+  Queue the macro for a button, in the lane for its priority. It will 
+    start playing on the next call to output_run(), if nothing else in
+    that lane is playing. The edge time is when the button press was
+    detected, on the monotonic clock, or zero if it isn't known, and
+    'decided' is when it was passed to the output thread. If the queue
+    is full, the overflow policy decides what happens. Returns FALSE if
+    the macro couldn't be queued, and should be tried again later.
+======================================================================*/
+BOOL output_start_macro (const MapEntry *entry, uint64_t edge_time,
+    uint64_t decided)
+  {
+  if (entry->nruns == 0) return TRUE;
+  Lane *l = &lanes[lane_for (entry)];
+  if (l->len == MAX_QUEUED_MACROS)
+    {
+    if (overflow_policy == OVERFLOW_COALESCE && is_waiting (l, entry)
+         && is_balanced (entry))
+      {
+      dbglog ("Queue full: merging press of pin %d\n", entry->pin);
+      counter_add (&stats.coalesced, 1);
+      trace (TRACE_OUTPUT, clock_now(), TRACE_COALESCE, 0, entry->pin, 0);
+      return TRUE;
+      }
+    if (overflow_policy != OVERFLOW_DROP_OLDEST || !drop_oldest (l))
+      return FALSE;
+    }
+  Playing *p = &l->queue[(l->head + l->len) % MAX_QUEUED_MACROS];
+  p->entry = entry;
+  p->next_run = 0;
+  p->next_event = 0;
+  p->edge_time = edge_time;
+  p->decided = decided;
+  l->len++;
+  if (entry->priority == PRIORITY_CANCEL) cancel_normal (edge_time);
+  return TRUE;
+  }
+
+/*======================================================================
+  note_keys
+  Keep track of the keys pressed and released by part of a run, which
+    is being output for a macro in lane 'l'
+======================================================================*/
+static void note_keys (Lane *l, int device, const MapRun *run, int first,
+    int end)
+  {
+  const struct input_event *events = mapimage_events (image, run);
+  uint8_t *down = l->keys_down[device];
+  for (int i = first; i < end; i++)
+    {
+    if (events[i].type != EV_KEY) continue;
+    int code = events[i].code;
+    if (events[i].value == 1) down[code / 8] |= 1 << (code % 8);
+    else if (events[i].value == 0) down[code / 8] &= ~(1 << (code % 8));
+    }
+  }
+
+/*======================================================================
+  release_keys
+  Release all the keys that the macros in lane 'l' are holding down,
+    one report per device. Returns FALSE if we have to wait for a 
+    device first; the keys that haven't been released yet are still
+    marked as down, so this can just be called again.
+======================================================================*/
+static BOOL release_keys (Lane *l, uint64_t now)
+  {
+  for (int d = 0; d < image->ndevices; d++)
+    {
+    uint8_t *down = l->keys_down[d];
+    BOOL any = FALSE;
+    for (int code = 0; code < KEY_CNT; code++)
+      {
+      if (!((down[code / 8] >> (code % 8)) & 1)) continue;
+      if (!any && !set_batch_device (d)) return FALSE;
+      any = TRUE;
+      // Leave room for the SYN
+      if (!batch_room (2)) return FALSE;
+      batch_event (EV_KEY, code, 0, now);
+      down[code / 8] &= ~(1 << (code % 8));
+      }
+    if (any) batch_event (EV_SYN, SYN_REPORT, 0, now);
+    }
+  return TRUE;
+  }
+
+/*======================================================================
+  play_lane
+  Add all the runs in lane 'l' that are due at time 'now' to the 
+    batch. Returns the number of nanoseconds until the next run is due,
+    -1 if there is nothing left to play, or OUTPUT_BLOCKED if we have 
+    to wait for the device to be writable before carrying on.
+======================================================================*/
+static int64_t play_lane (Lane *l, uint64_t now)
+  {
+  while (l->len > 0)
+    {
+    if (l->next_due > now) return l->next_due - now;
+    // Between runs, and between the parts of a long one, a normal macro
+    //   gives way to any urgent request that has arrived meanwhile; the
+    //   thread takes it from the ring and plays it first
+    if (l == &lanes[LANE_NORMAL] && ring_peek (&rings[LANE_URGENT]))
+      return 0;
+    Playing *p = &l->queue[l->head];
+    const MapEntry *e = p->entry;
+    const MapRun *run = &mapimage_runs (image, e)[p->next_run];
+    BOOL first = !has_started (p);
+    uint32_t device_pace = image->devices[e->device].pace_usec;
+    uint32_t pace = e->pace_usec > device_pace ? e->pace_usec : device_pace;
+    // A new macro on a paced device has to wait for the last report 
+    //   of the one before
+    if (first && device_next[e->device] > now)
+      {
+      l->next_due = device_next[e->device];
+      continue;
+      }
+    // A batch can only go to one device
+    if (!set_batch_device (e->device)) return OUTPUT_BLOCKED;
+
+    // Unless the macro is paced, the whole run goes at once
+    int end = run->nevents;
+    if (pace)
+      {
+      const struct input_event *events = mapimage_events (image, run);
+      for (end = p->next_event; end < run->nevents; end++)
+        {
+        if (events[end].type == EV_SYN && events[end].code == SYN_REPORT)
+          {
+          end++;
+          break;
+          }
+        }
+      }
+    // The first run of a macro is stamped with the time of the edge 
+    //   that caused it; later runs with the time they were due
+    if (!batch_room (1)) return OUTPUT_BLOCKED;
+    int done;
+    if (first)
+      {
+      done = batch_run (run, 0, end, p->edge_time);
+      batch_edges[batch_nedges] = p->edge_time;
+      batch_decided[batch_nedges++] = p->decided;
+      }
+    else
+      done = batch_run (run, p->next_event, end, l->next_due);
+    note_keys (l, e->device, run, p->next_event, done);
+    // A run that doesn't fit in the batch is written in parts. The rest
+    //   carries on from where this part stopped, when it has been 
+    //   written, as part of the same run.
+    if (done < end)
+      {
+      if (first) l->next_due = now;
+      p->next_event = done;
+      if (!flush_batch()) return OUTPUT_BLOCKED;
+      // If an urgent macro is going to cut in, end the report this part
+      //   stopped in the middle of first, so that the two don't get 
+      //   mixed up; the rest of it becomes a report of its own
+      const struct input_event *last = &mapimage_events (image, run)[done - 1];
+      if (l == &lanes[LANE_NORMAL] && ring_peek (&rings[LANE_URGENT])
+           && !(last->type == EV_SYN && last->code == SYN_REPORT))
+        batch_event (EV_SYN, SYN_REPORT, 0, now);
+      continue;
+      }
+
+    // Within a macro, measure the pause from when the run was due, not 
+    //   from now, so that a late wake-up doesn't make the whole macro 
+    //   drift. A pause at the end of a macro still holds up the next 
+    //   one, so it can be used to space macros out. Pacing works in the
+    //   same way, but a pause that is longer than the pacing interval 
+    //   takes its place.
+    uint64_t base = first ? now : l->next_due;
+    // A macro that was waiting for its device keeps to the device's 
+    //   timing, in the same way
+    if (first && device_pace 
+        && now - device_next[e->device] < device_pace * 1000ULL)
+      base = device_next[e->device];
+    if (device_pace) device_next[e->device] = base + device_pace * 1000ULL;
+    if (end < run->nevents)
+      {
+      p->next_event = end;
+      l->next_due = base + pace * 1000ULL;
+      }
+    else
+      {
+      uint32_t delay = run->delay_usec > pace ? run->delay_usec : pace;
+      l->next_due = base + delay * 1000ULL;
+      p->next_event = 0;
+      p->next_run++;
+      }
+    if (l->next_due < now) l->next_due = now;
+    if (p->next_run == e->nruns)
+      {
+      l->head = (l->head + 1) % MAX_QUEUED_MACROS;
+      l->len--;
+      }
+    }
+  return -1;
+  }
+
+/*======================================================================
+  output_run
+  Output all the runs that are due at time 'now'. Nothing in the normal
+    lane is played while there is anything in the urgent lane. Returns
+    the number of nanoseconds until the next run is due, -1 if there is
+    nothing left to play, or OUTPUT_BLOCKED if we have to wait for the 
+    device to be writable before carrying on.
+======================================================================*/
+int64_t output_run (uint64_t now)
+  {
+  // Finish anything left over from last time first
+  if (!flush_batch()) return OUTPUT_BLOCKED;
+  if (release_pending)
+    {
+    if (!release_keys (&lanes[LANE_NORMAL], now)) return OUTPUT_BLOCKED;
+    release_pending = FALSE;
+    }
+  int64_t wait = play_lane (&lanes[LANE_URGENT], now);
+  if (wait == -1) wait = play_lane (&lanes[LANE_NORMAL], now);
+  if (wait == OUTPUT_BLOCKED || !flush_batch()) return OUTPUT_BLOCKED;
+  return wait;
+  }
+
+/*======================================================================
+  output_start_nudge
+  Start moving the pointer for an entry with a nudge, from time 'now'
+======================================================================*/
+void output_start_nudge (const MapEntry *entry, uint64_t now)
+  {
+  Nudge *n = &nudges[entry - mapimage_entry (image, 0)];
+  if (n->active) return;
+  n->active = TRUE;
+  n->start = now;
+  n->frac_x = 0;
+  n->frac_y = 0;
+  // Start moving straight away, if nothing else is moving
+  if (nudges_active++ == 0 && image->naxes == 0) next_frame = now;
+  }
+
+/*======================================================================
+  output_stop_nudge
+======================================================================*/
+void output_stop_nudge (const MapEntry *entry)
+  {
+  Nudge *n = &nudges[entry - mapimage_entry (image, 0)];
+  if (!n->active) return;
+  n->active = FALSE;
+  nudges_active--;
+  }
+
+/*======================================================================
+  nudge_factor
+  Work out how much faster than its starting speed a nudge should move 
+    the pointer, in fixed point, 'held' nanoseconds after its button
+    was pressed. This rises from 1 to accel_max, following the entry's
+    acceleration curve.
+======================================================================*/
+static int64_t nudge_factor (const MapEntry *e, uint64_t held)
+  {
+  if (e->accel_max <= MAP_FIXED_ONE) return MAP_FIXED_ONE;
+  // How far along the ramp we are, from 0 to MAP_FIXED_ONE
+  int64_t ramp = MAP_FIXED_ONE;
+  uint64_t held_usec = held / 1000;
+  if (held_usec < e->accel_ramp_usec)
+    ramp = (held_usec * MAP_FIXED_ONE) / e->accel_ramp_usec;
+  if (e->accel_curve == ACCEL_QUADRATIC)
+    ramp = (ramp * ramp) / MAP_FIXED_ONE;
+  return MAP_FIXED_ONE 
+    + ((int64_t)(e->accel_max - MAP_FIXED_ONE) * ramp) / MAP_FIXED_ONE;
+  }
+
+/*======================================================================
+  nudge_step
+  Add a speed to the left-over fraction of a pixel, and return the
+    whole number of pixels to move, keeping the new fraction
+======================================================================*/
+static int nudge_step (int32_t *frac, int64_t speed)
+  {
+  int64_t total = *frac + speed;
+  // Round towards zero, so the fraction has the same sign as the speed
+  int64_t pixels = total / MAP_FIXED_ONE;
+  *frac = total - pixels * MAP_FIXED_ONE;
+  return pixels;
+  }
+
+/*======================================================================
+  read_axis
+  Read an axis's file, and scale the reading to the output range
+======================================================================*/
+static BOOL read_axis (int i, int32_t *value)
+  {
+  const MapAxis *a = mapimage_axis (image, i);
+  char buff[32];
+  ssize_t n = pread (axis_fds[i], buff, sizeof (buff) - 1, 0);
+  if (n <= 0) return FALSE;
+  buff[n] = 0;
+  char *end;
+  int64_t raw = strtol (buff, &end, 10);
+  if (end == buff) return FALSE;
+  int64_t lo = a->in_min < a->in_max ? a->in_min : a->in_max;
+  int64_t hi = a->in_min < a->in_max ? a->in_max : a->in_min;
+  if (raw < lo) raw = lo;
+  if (raw > hi) raw = hi;
+  *value = a->out_min + (raw - a->in_min) * ((int64_t)a->out_max 
+    - a->out_min) / ((int64_t)a->in_max - a->in_min);
+  return TRUE;
+  }
+
+/*======================================================================
+  device_moving
+  Check whether anything in a frame might move device 'd'
+======================================================================*/
+static BOOL device_moving (int d)
+  {
+  for (int i = 0; i < image->nentries; i++)
+    if (nudges[i].active && mapimage_entry (image, i)->device == d) 
+      return TRUE;
+  for (int i = 0; i < image->naxes; i++)
+    if (mapimage_axis (image, i)->device == d) return TRUE;
+  return FALSE;
+  }
+
+/*======================================================================
+  output_frame
+  If a frame is due at time 'now', output the pointer movement and 
+    axis changes for it, one report per device. Returns the number of 
+    nanoseconds until the next frame, -1 if nothing is moving, or
+    OUTPUT_BLOCKED if we have to wait for the device.
+======================================================================*/
+int64_t output_frame (uint64_t now)
+  {
+  if (nudges_active == 0 && image->naxes == 0) 
+    {
+    frame_device = 0;
+    return -1;
+    }
+  if (next_frame > now) return next_frame - now;
+  if (!flush_batch()) return OUTPUT_BLOCKED;
+
+  for (int d = frame_device; d < image->ndevices; d++)
+    {
+    if (!device_moving (d)) continue;
+    // Each device's report has to wait for the one before to be
+    //   written, and for room in the batch; if the device is busy, the
+    //   frame carries on from this device next time
+    if (!set_batch_device (d) || !batch_room (image->naxes + 3))
+      {
+      frame_device = d;
+      return OUTPUT_BLOCKED;
+      }
+    int dx = 0, dy = 0;
+    int start = batch_len;
+    for (int i = 0; i < image->nentries && nudges_active; i++)
+      {
+      const MapEntry *e = mapimage_entry (image, i);
+      if (!nudges[i].active || e->device != d) continue;
+      int64_t factor = nudge_factor (e, now - nudges[i].start);
+      dx += nudge_step (&nudges[i].frac_x, e->nudge_x * factor);
+      dy += nudge_step (&nudges[i].frac_y, e->nudge_y * factor);
+      }
+    if (dx == 0 && dy == 0 && image->naxes == 0) continue;
+    if (dx) batch_event (EV_REL, REL_X, dx, now);
+    if (dy) batch_event (EV_REL, REL_Y, dy, now);
+    for (int i = 0; i < image->naxes; i++)
+      {
+      int32_t value;
+      if (mapimage_axis (image, i)->device != d 
+           || !read_axis (i, &value) || value == axis_values[i]) continue;
+      axis_values[i] = value;
+      batch_event (EV_ABS, mapimage_axis (image, i)->code, value, now);
+      }
+    if (batch_len > start) batch_event (EV_SYN, SYN_REPORT, 0, now);
+    }
+  frame_device = 0;
+
+  // Keep to the frame rate, unless we have fallen a whole frame behind.
+  //   The frame is finished now, even if the device makes us wait for
+  //   the last of it to be written.
+  next_frame += image->frame_usec * 1000ULL;
+  if (next_frame <= now) next_frame = now + image->frame_usec * 1000ULL;
+  if (!flush_batch()) return OUTPUT_BLOCKED;
+  return next_frame - now;
+  }
+
+/*======================================================================
+  ring_peek
+  Look at the next request in the ring buffer, without removing it. 
+    Returns NULL if it is empty. Only called from the output thread.
+======================================================================*/
+static const OutputRequest *ring_peek (Ring *r)
+  {
+  unsigned head = atomic_load_explicit (&r->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit (&r->tail, memory_order_acquire);
+  if (head == tail) return NULL;
+  return &r->slots[head & RING_MASK];
+  }
+
+/*======================================================================
+  ring_pop
+  Remove the request that ring_peek() returned
+======================================================================*/
+static void ring_pop (Ring *r)
+  {
+  unsigned head = atomic_load_explicit (&r->head, memory_order_relaxed);
+  atomic_store_explicit (&r->head, head + 1, memory_order_release);
+  }
+
+/*======================================================================
+  output_submit
+  Pass a button press or release to the output thread, in the ring for
+    its lane. Only called from the main loop; releases only matter for
+    nudges. This never blocks: if the ring is full, which means the
+    output thread is hopelessly behind, the press is dropped. Drops are
+    counted in the ring statistics, and reported at most once a second,
+    so that a flood of them doesn't slow the main loop down further.
+  A release is never dropped, or the pointer would carry on moving: a
+    nudge's press is only passed on if it leaves room in the ring for 
+    the releases of all the nudges that are still held. If the press
+    was dropped, its release has nothing to stop, and is ignored.
+======================================================================*/
+void output_submit (const MapEntry *entry, BOOL pressed, 
+    uint64_t edge_time)
+  {
+  int i = entry - mapimage_entry (image, 0);
+  int lane = lane_for (entry);
+  if (!pressed && !release_owed[i]) return;
+  BOOL owes = pressed && mapentry_has_nudge (entry) && !release_owed[i];
+  Ring *r = &rings[lane];
+  unsigned tail = atomic_load_explicit (&r->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit (&r->head, memory_order_acquire);
+  unsigned room = OUTPUT_RING_SIZE - (tail - head);
+  if (pressed && room < 1 + owes + releases_owed[lane])
+    {
+    counter_add (&ring_stats.full, 1);
+    trace (TRACE_MAIN, edge_time, TRACE_RING_FULL, 0, entry->pin, 0);
+    uint64_t now = clock_now();
+    if (full_reported_time == 0 
+         || now - full_reported_time >= RING_FULL_REPORT_NSEC)
+      {
+      uint64_t full = counter_get (&ring_stats.full);
+      fprintf (stderr, "Output thread is not keeping up: %llu press(es) "
+        "ignored, the last on pin %d\n", 
+        (unsigned long long)(full - full_reported), entry->pin);
+      full_reported = full;
+      full_reported_time = now;
+      }
+    return;
+    }
+  OutputRequest *req = &r->slots[tail & RING_MASK];
+  req->entry = entry;
+  req->pressed = pressed;
+  req->edge_time = edge_time;
+  req->decided = clock_now();
+  if (pressed && edge_time != 0) 
+    hist_record (&ring_stats.accept, req->decided - edge_time);
+  atomic_store_explicit (&r->tail, tail + 1, memory_order_release);
+  counter_add (&ring_stats.submitted, 1);
+  if (owes) releases_owed[lane]++;
+  if (!pressed) releases_owed[lane]--;
+  release_owed[i] = pressed && (owes || release_owed[i]);
+  if (tail + 1 - head > counter_get (&ring_stats.high_water)) 
+    counter_set (&ring_stats.high_water, tail + 1 - head);
+
+  // This pairs with the check in output_thread_main(): either the thread
+  //   sees the new request before it sleeps, or we see that it is asleep
+  atomic_thread_fence (memory_order_seq_cst);
+  if (atomic_load_explicit (&thread_sleeping, memory_order_relaxed))
+    {
+    uint64_t one = 1;
+    write (wake_fd, &one, sizeof (one));
+    }
+  }
+
+/*======================================================================
+  earliest
+  Combine two waits, as returned by output_run() and output_frame()
+======================================================================*/
+static int64_t earliest (int64_t a, int64_t b)
+  {
+  if (a == OUTPUT_BLOCKED || b == OUTPUT_BLOCKED) return OUTPUT_BLOCKED;
+  if (a < 0) return b;
+  if (b < 0) return a;
+  return a < b ? a : b;
+  }
+
+/*======================================================================
+  output_thread_main
+  Take requests from the ring, and play them, sleeping until the next
+    run of a macro is due, another request arrives, or the device
+    becomes writable, if it was busy.
+======================================================================*/
+static void *output_thread_main (void *arg)
+  {
+  int64_t wait_nsec = 0; // Check straight away, in case there are axes
+  uint64_t deadline = 0;
+  const OutputRequest *stalled_req[NUM_LANES] = {NULL, NULL};
+  clock_follow();
+  while (!atomic_load (&thread_stop))
+    {
+    // Take requests from each ring, urgent ones first, until one can't
+    //   be queued; that one stays in the ring until there is room for it
+    BOOL got_any = FALSE;
+    BOOL stalled[NUM_LANES] = {FALSE, FALSE};
+    // Say we are working before taking anything from a ring, so that
+    //   output_idle() never sees an empty ring and an idle thread while
+    //   a request is on its way
+    for (int lane = 0; lane < NUM_LANES; lane++)
+      if (ring_peek (&rings[lane])) atomic_store (&thread_working, 1);
+    for (int lane = NUM_LANES - 1; lane >= 0; lane--)
+      {
+      Ring *r = &rings[lane];
+      const OutputRequest *req;
+      while ((req = ring_peek (r)) != NULL)
+        {
+        if (!req->pressed)
+          {
+          output_stop_nudge (req->entry);
+          ring_pop (r);
+          continue;
+          }
+        // A normal press from before a cancelling one was too late
+        if (lane == LANE_NORMAL && req->edge_time != 0 
+             && req->edge_time <= cancel_time)
+          {
+          counter_add (&stats.cancelled, 1);
+          ring_pop (r);
+          continue;
+          }
+        if (mapentry_has_nudge (req->entry))
+          output_start_nudge (req->entry, clock_now());
+        if (!output_start_macro (req->entry, req->edge_time, 
+             req->decided))
+          {
+          // Count each press that has to wait only once, however many
+          //   times we try it
+          if (req != stalled_req[lane]) counter_add (&stats.blocked, 1);
+          stalled_req[lane] = req;
+          stalled[lane] = TRUE;
+          break;
+          }
+        stalled_req[lane] = NULL;
+        ring_pop (r);
+        got_any = TRUE;
+        }
+      }
+    if (got_any || wait_nsec == 0)
+      {
+      uint64_t now = clock_now();
+      wait_nsec = earliest (output_run (now), output_frame (now));
+      atomic_store (&thread_working, lanes[LANE_NORMAL].len > 0
+        || lanes[LANE_URGENT].len > 0 || batch_len > 0);
+      counter_set (&stats.queued[LANE_NORMAL], lanes[LANE_NORMAL].len);
+      counter_set (&stats.queued[LANE_URGENT], lanes[LANE_URGENT].len);
+      // This is exactly the time the next run or frame was due, since
+      //   the wait was worked out from the same 'now'
+      deadline = now + wait_nsec;
+      continue;
+      }
+
+    atomic_store (&thread_sleeping, 1);
+    atomic_thread_fence (memory_order_seq_cst);
+    BOOL idle = !atomic_load (&thread_stop);
+    unsigned tails[NUM_LANES];
+    for (int lane = 0; lane < NUM_LANES; lane++)
+      {
+      Ring *r = &rings[lane];
+      tails[lane] = atomic_load_explicit (&r->tail, memory_order_acquire);
+      if (!stalled[lane] 
+           && atomic_load_explicit (&r->head, memory_order_relaxed) 
+              != tails[lane]) 
+        idle = FALSE;
+      }
+    if (idle)
+      {
+      for (int lane = 0; lane < NUM_LANES; lane++)
+        atomic_store (&seen_tail[lane], tails[lane]);
+      // Sleep until the absolute time that the next thing is due, so
+      //   that time spent getting here doesn't delay it
+      struct pollfd pfd[2] = {{wake_fd, POLLIN, 0}, 
+                              {wait_nsec == OUTPUT_BLOCKED ? batch_fd : -1,
+                                 POLLOUT, 0}};
+      if (clock_poll (pfd, 2, wait_nsec > 0 ? deadline : CLOCK_NEVER) > 0
+           && (pfd[0].revents & POLLIN))
+        {
+        uint64_t count;
+        read (wake_fd, &count, sizeof (count));
+        }
+      counter_add (&stats.wakeups, 1);
+      }
+    atomic_store (&thread_sleeping, 0);
+    // Either a request has arrived, a run is due, or the device is
+    //   ready; in all cases output_run() will work out what to do
+    wait_nsec = 0;
+    }
+  // Macros that are cut short leave their keys down. A uinput device
+  //   releases them when it is destroyed, but the other sinks don't.
+  drain_batch();
+  for (int lane = 0; lane < NUM_LANES; lane++)
+    while (!release_keys (&lanes[lane], clock_now()))
+      drain_batch();
+  drain_batch();
+  return NULL;
+  }
+
+/*======================================================================
+  output_start_thread
+  Start the output thread. Signals are blocked in the thread, so that
+    they are always handled by the main loop.
+======================================================================*/
+void output_start_thread (const Sink *_sink, const int *fds, 
+    const MapImage *_image)
+  {
+  output_init (_sink, fds, _image);
+  wake_fd = eventfd (0, EFD_NONBLOCK);
+  sigset_t all, old;
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  if (wake_fd < 0
+      || pthread_create (&output_thread, NULL, output_thread_main, NULL))
+    {
+    fprintf (stderr, "Can't start output thread: %s\n", strerror (errno));
+    exit (-1);
+    }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  }
+
+/*======================================================================
+  output_stop_thread
+  Stop the output thread, and wait for it to finish. Anything still
+    queued is abandoned.
+======================================================================*/
+void output_stop_thread (void)
+  {
+  atomic_store (&thread_stop, 1);
+  uint64_t one = 1;
+  write (wake_fd, &one, sizeof (one));
+  pthread_join (output_thread, NULL);
+  close (wake_fd);
+  }
+
+/*======================================================================
+  output_idle
+  Check whether the output thread has finished everything it has been
+    given. Only called from the main loop.
+======================================================================*/
+BOOL output_idle (void)
+  {
+  for (int lane = 0; lane < NUM_LANES; lane++)
+    {
+    Ring *r = &rings[lane];
+    if (atomic_load_explicit (&r->head, memory_order_acquire) 
+         != atomic_load_explicit (&r->tail, memory_order_relaxed))
+      return FALSE;
+    }
+  return !atomic_load (&thread_working);
+  }
+
+/*======================================================================
+  output_get_ring_stats
+  Get the ring buffer statistics. Only meaningful from the main loop.
+======================================================================*/
+const RingStats *output_get_ring_stats (void)
+  {
+  return &ring_stats;
+  }
+
+/*======================================================================
+  output_settled
+  Check whether the output thread has taken everything it has been 
+    given from the rings, or found that it can't yet, and gone to 
+    sleep. This is what the virtual clock needs to know before it can
+    move on to the thread's next deadline. Only called from the main 
+    loop.
+======================================================================*/
+BOOL output_settled (void)
+  {
+  for (int lane = 0; lane < NUM_LANES; lane++)
+    {
+    if (atomic_load_explicit (&rings[lane].tail, memory_order_relaxed)
+         != atomic_load (&seen_tail[lane]))
+      return FALSE;
+    }
+  return TRUE;
+  }
+
+/*======================================================================
+  output_ring_depth
+  Get the number of requests waiting in the ring for a lane, 0 for 
+    normal or 1 for urgent. This can be called from any thread.
+======================================================================*/
+unsigned output_ring_depth (int lane)
+  {
+  Ring *r = &rings[lane];
+  unsigned head = atomic_load_explicit (&r->head, memory_order_acquire);
+  unsigned tail = atomic_load_explicit (&r->tail, memory_order_acquire);
+  return tail - head;
+  }
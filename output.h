@@ -0,0 +1,80 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  output.h
+
+  Functions for sending events to the output devices, and for playing
+    macros. Normally all this is done by an output thread, which the 
+    main loop passes button presses to with output_submit().
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#pragma once
+
+#include "defs.h"
+#include "mapping.h"
+#include "sink.h"
+#include "stats.h"
+
+// Output statistics, only written by the output thread. Times are in 
+//   nanoseconds.
+typedef struct _OutputStats
+  {
+  Histogram latency;      // GPIO edge to output, for each macro started
+  Histogram accept_to_emit; // Passed on by the main loop, to output
+  Histogram emit_duration;  // Time to write each batch of events
+  Counter events;         // Events written
+  Counter writes;         // Calls to write() that wrote something
+  Counter device_busy;    // Times the device couldn't take any more events
+  Counter errors;         // Batches abandoned, after an error or timeout
+  Counter blocked;        // Times a press had to wait for the queue
+  Counter dropped;        // Queued macros discarded to make room
+  Counter coalesced;      // Presses merged with one already queued
+  Counter cancelled;      // Macros abandoned for a cancelling one
+  Counter queued[2];      // Macros waiting in the normal and urgent lanes
+  Counter wakeups;        // Times the thread slept, and woke up again
+  } OutputStats;
+
+// What to do with a button press when the macro queue is full
+typedef enum
+  {
+  OVERFLOW_BLOCK = 0,     // Wait until there is room
+  OVERFLOW_DROP_OLDEST,   // Discard the oldest macro that hasn't started
+  OVERFLOW_COALESCE       // Discard it, if the same macro is waiting
+  } OverflowPolicy;
+
+// output_run() returns this when it is waiting for the device
+#define OUTPUT_BLOCKED (-2)
+
+// Statistics for the ring buffer between the main loop and the output
+//   thread, only written by the main loop
+typedef struct _RingStats
+  {
+  Counter submitted;      // Button presses passed to the output thread
+  Counter full;           // Presses dropped because the ring was full
+  Counter high_water;     // Most requests ever waiting in the ring
+  Histogram accept;       // GPIO edge to being passed on, for presses
+  } RingStats;
+
+void output_init (const Sink *sink, const int *fds, const MapImage *image);
+BOOL output_start_macro (const MapEntry *entry, uint64_t edge_time,
+       uint64_t decided);
+int64_t output_run (uint64_t now);
+const OutputStats *output_get_stats (void);
+void output_set_overflow (OverflowPolicy policy);
+int output_overflow_from_name (const char *name);
+void output_set_probe (BOOL on);
+void output_start_thread (const Sink *sink, const int *fds, 
+       const MapImage *image);
+void output_stop_thread (void);
+BOOL output_idle (void);
+BOOL output_settled (void);
+void output_submit (const MapEntry *entry, BOOL pressed, 
+       uint64_t edge_time);
+void output_start_nudge (const MapEntry *entry, uint64_t now);
+void output_stop_nudge (const MapEntry *entry);
+int64_t output_frame (uint64_t now);
+const RingStats *output_get_ring_stats (void);
+unsigned output_ring_depth (int lane);
@@ -0,0 +1,260 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  probe.c
+
+  The latency probe. Each uinput device has an evdev node, which we
+    open like any other program reading input would. When the output
+    thread has written a batch of events to uinput, the kernel has
+    already delivered them to every evdev reader, so we can just read
+    them back there and then, without a thread of our own.
+
+  For each press, four times are known: the GPIO edge, when the main
+    loop woke up for it; the decision, when the main loop passed the
+    press to the output thread, after debouncing; the write, when the
+    output thread started writing the batch with the press's first
+    events; and the delivery, which is the timestamp the kernel put on
+    the events as it passed them to evdev. For the kernel to do that,
+    the output thread stops stamping events with the edge time while
+    the probe is running. The evdev nodes are switched to the monotonic
+    clock, so all four times are comparable.
+
+  A batch that is bigger than evdev's buffer overflows it, and the
+    earliest events are lost; the delivery time is then a little late.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+#include "probe.h"
+
+// PROBE_MAX_SAMPLES is the number of presses whose latency is kept.
+//   Presses after that are counted, but not measured.
+#define PROBE_MAX_SAMPLES 100000
+
+// PROBE_OPEN_MSEC is how long we wait for udev to create the evdev
+//   node for a new uinput device
+#define PROBE_OPEN_MSEC 2000
+
+// The intervals that are measured for each press
+typedef enum
+  {
+  STAGE_DECIDE = 0,       // Edge to decision
+  STAGE_QUEUE,            // Decision to write
+  STAGE_KERNEL,           // Write to delivery
+  STAGE_TOTAL,            // Edge to delivery
+  NUM_STAGES
+  } Stage;
+
+static const char *stage_names[NUM_STAGES] =
+  {
+  "edge to decision",
+  "decision to write",
+  "write to delivery",
+  "edge to delivery"
+  };
+
+static int evdev_fds[MAX_DEVICES];
+static int ndevices = 0;
+static uint64_t *samples[NUM_STAGES];
+static int nsamples = 0;
+static uint64_t presses = 0;  // Including those that weren't measured
+static uint64_t unseen = 0;   // Presses whose events never arrived
+
+/*======================================================================
+  find_evdev
+  Find the evdev node for a uinput device, whose name in sysfs is, for
+    example, input7. Returns the path of the node in 'path', or FALSE
+    if there isn't one.
+======================================================================*/
+static BOOL find_evdev (const char *sysname, char *path, size_t len)
+  {
+  char dirname[300];
+  snprintf (dirname, sizeof (dirname), "/sys/class/input/%s", sysname);
+  DIR *dir = opendir (dirname);
+  if (!dir) return FALSE;
+  struct dirent *de;
+  BOOL found = FALSE;
+  while (!found && (de = readdir (dir)) != NULL)
+    {
+    if (strncmp (de->d_name, "event", 5) != 0) continue;
+    snprintf (path, len, "/dev/input/%s", de->d_name);
+    found = TRUE;
+    }
+  closedir (dir);
+  return found;
+  }
+
+/*======================================================================
+  open_evdev
+  Open the evdev node for the uinput device on 'fd'. A new node might
+    not have appeared yet, so keep trying for a while.
+======================================================================*/
+static int open_evdev (int fd)
+  {
+  char sysname[64];
+  if (ioctl (fd, UI_GET_SYSNAME (sizeof (sysname)), sysname) < 0)
+    {
+    fprintf (stderr, "Can't get uinput device name: %s\n",
+      strerror (errno));
+    exit (-1);
+    }
+  char path[300];
+  int evfd = -1;
+  for (int waited = 0; evfd < 0 && waited < PROBE_OPEN_MSEC;
+       waited += 50)
+    {
+    if (find_evdev (sysname, path, sizeof (path)))
+      evfd = open (path, O_RDONLY | O_NONBLOCK);
+    if (evfd < 0) usleep (50000);
+    }
+  if (evfd < 0)
+    {
+    fprintf (stderr, "Can't open the evdev node for %s\n", sysname);
+    exit (-1);
+    }
+  int clock = CLOCK_MONOTONIC;
+  if (ioctl (evfd, EVIOCSCLOCKID, &clock) < 0)
+    {
+    fprintf (stderr, "Can't set the clock for %s: %s\n", path,
+      strerror (errno));
+    exit (-1);
+    }
+  dbglog ("Probing %s at %s\n", sysname, path);
+  return evfd;
+  }
+
+/*======================================================================
+  probe_open
+  Open the evdev node of each of the image's devices, which are on 'fds'
+    from the uinput sink. Devices that the sink didn't open are skipped.
+    Any other failure is fatal.
+======================================================================*/
+void probe_open (const int *fds, const MapImage *image)
+  {
+  ndevices = image->ndevices;
+  for (int d = 0; d < ndevices; d++)
+    evdev_fds[d] = fds[d] >= 0 ? open_evdev (fds[d]) : -1;
+  for (int s = 0; s < NUM_STAGES; s++)
+    {
+    samples[s] = malloc (PROBE_MAX_SAMPLES * sizeof (uint64_t));
+    if (!samples[s])
+      {
+      fprintf (stderr, "Out of memory\n");
+      exit (-1);
+      }
+    }
+  }
+
+/*======================================================================
+  probe_batch
+  Called by the output thread when it has written a batch of events to
+    a device. The batch started the macros for 'n' presses, with the
+    edge and decision times given, and its first write() was at
+    'write_start'. We read back everything that is waiting on the
+    device's evdev node, and the earliest timestamp is the delivery
+    time of the batch. Presses on a device that isn't being probed
+    count as not seen.
+======================================================================*/
+void probe_batch (int device, const uint64_t *edges,
+    const uint64_t *decided, int n, uint64_t write_start)
+  {
+  struct input_event events[64];
+  uint64_t delivered = UINT64_MAX;
+  ssize_t len;
+  while (evdev_fds[device] >= 0
+         && (len = read (evdev_fds[device], events, sizeof (events))) > 0)
+    {
+    for (int i = 0; i < len / sizeof (struct input_event); i++)
+      {
+      uint64_t t = (uint64_t)events[i].input_event_sec * 1000000000ULL
+        + events[i].input_event_usec * 1000ULL;
+      if (t < delivered) delivered = t;
+      }
+    }
+  for (int i = 0; i < n; i++)
+    {
+    if (edges[i] == 0) continue;
+    presses++;
+    if (delivered == UINT64_MAX)
+      {
+      unseen++;
+      continue;
+      }
+    if (nsamples == PROBE_MAX_SAMPLES) continue;
+    samples[STAGE_DECIDE][nsamples] = decided[i] - edges[i];
+    samples[STAGE_QUEUE][nsamples] = write_start - decided[i];
+    // The delivery can be timed a little before the write started,
+    //   since the clock is only read to the microsecond
+    samples[STAGE_KERNEL][nsamples] = delivered > write_start
+      ? delivered - write_start : 0;
+    samples[STAGE_TOTAL][nsamples] = delivered - edges[i];
+    nsamples++;
+    }
+  }
+
+/*======================================================================
+  compare_samples
+======================================================================*/
+static int compare_samples (const void *a, const void *b)
+  {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+  }
+
+/*======================================================================
+  percentile
+  Get the sample at 'per_mille' thousandths of the way through a
+    sorted array of samples
+======================================================================*/
+static uint64_t percentile (const uint64_t *sorted, int n, int per_mille)
+  {
+  return sorted[(long)(n - 1) * per_mille / 1000];
+  }
+
+/*======================================================================
+  probe_report
+  Print the 50th, 99th and 99.9th percentiles, and the maximum, of each
+    stage of the latency. This sorts the samples, so it should only be
+    called once the output thread has stopped.
+======================================================================*/
+void probe_report (FILE *f)
+  {
+  fprintf (f, "Latency probe: %llu presses, %d measured, %llu not seen\n",
+    (unsigned long long)presses, nsamples, (unsigned long long)unseen);
+  if (nsamples == 0) return;
+  fprintf (f, "  %-20s %9s %9s %9s %9s\n", "(ms)", "p50", "p99",
+    "p99.9", "max");
+  for (int s = 0; s < NUM_STAGES; s++)
+    {
+    qsort (samples[s], nsamples, sizeof (uint64_t), compare_samples);
+    fprintf (f, "  %-20s %9.3f %9.3f %9.3f %9.3f\n", stage_names[s],
+      percentile (samples[s], nsamples, 500) / 1e6,
+      percentile (samples[s], nsamples, 990) / 1e6,
+      percentile (samples[s], nsamples, 999) / 1e6,
+      samples[s][nsamples - 1] / 1e6);
+    }
+  }
+
+/*======================================================================
+  probe_close
+======================================================================*/
+void probe_close (void)
+  {
+  for (int d = 0; d < ndevices; d++)
+    if (evdev_fds[d] >= 0) close (evdev_fds[d]);
+  for (int s = 0; s < NUM_STAGES; s++)
+    free (samples[s]);
+  ndevices = 0;
+  }
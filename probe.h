@@ -0,0 +1,25 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  probe.h
+
+  The latency probe reads back the events written to the uinput devices,
+    from their /dev/input/eventX nodes, to measure how long each press
+    takes to get from the GPIO edge to the programs that read the
+    device. It is enabled with --latency.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#pragma once
+
+#include <stdio.h>
+#include "defs.h"
+#include "mapping.h"
+
+void probe_open (const int *fds, const MapImage *image);
+void probe_batch (int device, const uint64_t *edges,
+       const uint64_t *decided, int n, uint64_t write_start);
+void probe_report (FILE *f);
+void probe_close (void);
@@ -0,0 +1,105 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  record.c
+
+  Writing and reading recordings of raw GPIO edges -- see record.h.
+    Records are written through stdio, so recording costs the main loop
+    a copy into a buffer, not a system call, for each level it reads.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "record.h"
+
+static FILE *record_file = NULL;
+
+/*======================================================================
+  record_open
+  Start recording to a file. Any failure is fatal.
+======================================================================*/
+void record_open (const char *filename, uint64_t start_nsec)
+  {
+  record_file = fopen (filename, "wb");
+  if (!record_file)
+    {
+    fprintf (stderr, "Can't write %s: %s\n", filename, strerror (errno));
+    exit (-1);
+    }
+  RecordHeader h;
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, RECORD_MAGIC, 4);
+  h.version = RECORD_VERSION;
+  h.start_nsec = start_nsec;
+  fwrite (&h, sizeof (h), 1, record_file);
+  }
+
+/*======================================================================
+  record_edge
+  Record a level read from a pin, if we are recording. A level of -1
+    means the read failed.
+======================================================================*/
+void record_edge (uint64_t nsec, int pin, int level, int flags)
+  {
+  if (!record_file) return;
+  EdgeRecord r;
+  r.nsec = nsec;
+  r.pin = pin;
+  r.flags = flags | (level < 0 ? RECORD_FAILED 
+    : level ? RECORD_LEVEL : 0);
+  fwrite (&r, sizeof (r), 1, record_file);
+  }
+
+/*======================================================================
+  record_close
+======================================================================*/
+void record_close (void)
+  {
+  if (!record_file) return;
+  fclose (record_file);
+  record_file = NULL;
+  }
+
+/*======================================================================
+  record_load
+  Read a whole recording into memory. Returns the records, which the
+    caller must free(), and sets the program's start time and the
+    number of records. Any error is fatal.
+======================================================================*/
+EdgeRecord *record_load (const char *filename, uint64_t *start_nsec,
+    long *nrecords)
+  {
+  FILE *f = fopen (filename, "rb");
+  if (!f)
+    {
+    fprintf (stderr, "Can't open %s: %s\n", filename, strerror (errno));
+    exit (-1);
+    }
+  RecordHeader h;
+  struct stat sb;
+  fstat (fileno (f), &sb);
+  if (fread (&h, sizeof (h), 1, f) != 1
+       || memcmp (h.magic, RECORD_MAGIC, 4) != 0
+       || h.version != RECORD_VERSION)
+    {
+    fprintf (stderr, "%s is not an edge recording\n", filename);
+    exit (-1);
+    }
+  long n = (sb.st_size - sizeof (h)) / sizeof (EdgeRecord);
+  EdgeRecord *records = malloc ((n ? n : 1) * sizeof (EdgeRecord));
+  if (!records || fread (records, sizeof (EdgeRecord), n, f) != n)
+    {
+    fprintf (stderr, "Can't read %s\n", filename);
+    exit (-1);
+    }
+  fclose (f);
+  *start_nsec = h.start_nsec;
+  *nrecords = n;
+  return records;
+  }
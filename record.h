@@ -0,0 +1,53 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  record.h
+
+  Recordings of raw GPIO edges. With --record, the main loop logs every
+    level it reads from a pin, with the time it read it, and --replay
+    feeds a recording back through the debouncing and output, on the
+    recording's own clock, so that the bounce behaviour of a unit in
+    the field can be reproduced exactly.
+
+  A recording is a RecordHeader, followed by EdgeRecords in time order,
+    in the byte order of the machine that made it.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+
+#define RECORD_MAGIC "PBKE"
+#define RECORD_VERSION 1
+
+typedef struct _RecordHeader
+  {
+  char magic[4];
+  uint32_t version;
+  uint64_t start_nsec;    // When the program started, on the same clock
+  } RecordHeader;
+
+// An EdgeRecord is written each time the main loop wakes up for an
+//   edge on a pin, and each time it reads a pin again later on, such as
+//   after waiting for the level to settle. Only the first kind are
+//   edges; the others just say what level the pin had at the time.
+typedef struct __attribute__((packed)) _EdgeRecord
+  {
+  uint64_t nsec;          // Monotonic time
+  uint16_t pin;
+  uint8_t flags;
+  } EdgeRecord;
+
+#define RECORD_LEVEL 0x01     // The level that was read
+#define RECORD_SETTLED 0x02   // Not an edge: the pin was read again
+#define RECORD_FAILED 0x04    // The read failed
+
+void record_open (const char *filename, uint64_t start_nsec);
+void record_edge (uint64_t nsec, int pin, int level, int flags);
+void record_close (void);
+EdgeRecord *record_load (const char *filename, uint64_t *start_nsec,
+       long *nrecords);
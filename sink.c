@@ -0,0 +1,357 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  sink.c
+
+  The output sinks -- see sink.h. Each is selected with --sink NAME or
+    --sink NAME:ARG:
+
+    uinput              uinput devices, as declared in the mappings
+                          (the default)
+    text:PATH[,LAYOUT]  type the characters the keys would produce on
+                          a serial port, or on a new pty if PATH is 
+                          'pty', using LAYOUT (us by default)
+    socket:PATH         stream SinkEvent records to a Unix socket
+    json                print one JSON object per event on stdout
+
+  Apart from uinput, all the devices share one descriptor. The output
+    code writes each batch of events with a single write(), after the 
+    sink has encoded it.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/uinput.h>
+#include "sink.h"
+#include "layout.h"
+
+// The text sink's state: the layout, and the modifiers that are down
+static const Layout *text_layout = NULL;
+static int text_mods = 0;
+static BOOL text_ctrl = FALSE;
+
+/*======================================================================
+  open_device 
+  Open and prepare one uinput device. If any of this fails, exit the
+    program -- there is nothing useful to be done afterwards.
+======================================================================*/
+static int open_device (const MapImage *image, int index)
+  {
+  const MapDevice *device = &image->devices[index];
+  int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if (fd > 0)
+    {
+    // We need to export all the event types and key codes in the macros
+    //   sent to this device. The image has a bitmap of them, so each is
+    //   only exported once, however many times it is used
+    uint32_t evbits = device->evbits;
+    // Without pointer axes, a mouse wouldn't be recognized as one
+    if (device->type == DEVICE_MOUSE) evbits |= 1 << EV_REL;
+    for (int type = 0; type < 32; type++)
+      {
+      if (evbits & (1 << type))
+        ioctl (fd, UI_SET_EVBIT, type);
+      }
+    for (int code = 0; code < KEY_CNT; code++)
+      {
+      if (mapdevice_has_key (device, code))
+        ioctl (fd, UI_SET_KEYBIT, code);
+      }
+    uint32_t relbits = device->relbits;
+    if (device->type == DEVICE_MOUSE) relbits |= (1 << REL_X) | (1 << REL_Y);
+    for (int code = 0; code < 32; code++)
+      {
+      if (relbits & (1 << code))
+        ioctl (fd, UI_SET_RELBIT, code);
+      }
+    // An absolute axis needs its range as well
+    for (int i = 0; i < image->naxes; i++)
+      {
+      const MapAxis *a = mapimage_axis (image, i);
+      if (a->device != index) continue;
+      struct uinput_abs_setup abs;
+      memset (&abs, 0, sizeof (abs));
+      abs.code = a->code;
+      abs.absinfo.minimum = a->out_min < a->out_max ? a->out_min : a->out_max;
+      abs.absinfo.maximum = a->out_min < a->out_max ? a->out_max : a->out_min;
+      ioctl (fd, UI_SET_ABSBIT, a->code);
+      ioctl (fd, UI_ABS_SETUP, &abs);
+      }
+
+    // Create the dummy input device
+    // This will create a new /dev/input/eventXX device, that will
+    //   feed into the kernel's input subsystem. Each type of device
+    //   gets its own product ID, in case anything cares.
+    struct uinput_setup usetup;
+    memset (&usetup, 0, sizeof(usetup));
+    usetup.id.bustype = BUS_USB;
+    usetup.id.vendor = 0x1234; // Dummy
+    usetup.id.product = 0x5678 + device->type; // Dummy
+    strncpy (usetup.name, device->name, UINPUT_MAX_NAME_SIZE - 1);
+    ioctl (fd, UI_DEV_SETUP, &usetup);
+    ioctl (fd, UI_DEV_CREATE);
+
+    return fd;
+    } 
+  else
+    {
+    fprintf (stderr, "Can't open /dev/uinput: %s\n", strerror (errno));
+    exit (-1);
+    return -1; 
+    }
+  }
+
+/*======================================================================
+  open_uinput 
+  Create all the devices in the image, and store their file 
+    descriptors in 'fds', which is indexed like the image's device 
+    array. A device that nothing is sent to isn't created, and its
+    descriptor is -1.
+======================================================================*/
+static void open_uinput (const char *arg, const MapImage *image, int *fds)
+  {
+  for (int i = 0; i < image->ndevices; i++)
+    {
+    const MapDevice *device = &image->devices[i];
+    if (device->evbits == 0)
+      {
+      dbglog ("Device '%s' is not used\n", device->name);
+      fds[i] = -1;
+      continue;
+      }
+    dbglog ("Creating %s device '%s'\n", device_type_name (device->type), 
+      device->name);
+    fds[i] = open_device (image, i);
+    }
+  }
+
+/*======================================================================
+  close_uinput 
+======================================================================*/
+static void close_uinput (const int *fds, int nfds)
+  {
+  // Easy -- nothing else to do in this current implementation
+  for (int i = 0; i < nfds; i++)
+    {
+    if (fds[i] >= 0) close (fds[i]);
+    }
+  }
+
+/*======================================================================
+  share_fd
+  Use the same descriptor for all the devices
+======================================================================*/
+static void share_fd (int fd, const MapImage *image, int *fds)
+  {
+  for (int i = 0; i < image->ndevices; i++)
+    fds[i] = fd;
+  }
+
+/*======================================================================
+  close_shared
+======================================================================*/
+static void close_shared (const int *fds, int nfds)
+  {
+  if (nfds > 0) close (fds[0]);
+  }
+
+/*======================================================================
+  open_text
+  Open the serial port or pty for the text sink
+======================================================================*/
+static void open_text (const char *arg, const MapImage *image, int *fds)
+  {
+  if (!arg)
+    {
+    fprintf (stderr, "The text sink needs a device, or 'pty'\n");
+    exit (-1);
+    }
+  char *path = strdup (arg);
+  char *layout_name = strchr (path, ',');
+  if (layout_name) *layout_name++ = 0;
+  text_layout = layout_find (layout_name ? layout_name : "us");
+  if (!text_layout)
+    {
+    fprintf (stderr, "Unknown keyboard layout '%s'\n", layout_name);
+    exit (-1);
+    }
+
+  int fd;
+  if (strcmp (path, "pty") == 0)
+    {
+    fd = posix_openpt (O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd >= 0 && grantpt (fd) == 0 && unlockpt (fd) == 0)
+      fprintf (stderr, "Text output on %s\n", ptsname (fd));
+    else
+      fd = -1;
+    }
+  else
+    fd = open (path, O_WRONLY | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0)
+    {
+    fprintf (stderr, "Can't open %s: %s\n", path, strerror (errno));
+    exit (-1);
+    }
+  free (path);
+  share_fd (fd, image, fds);
+  }
+
+/*======================================================================
+  encode_text
+  Turn key presses into the characters they would type, keeping track
+    of the modifiers. Enter, Backspace and Escape send what a terminal
+    would, and Ctrl with a letter sends the control character, so 
+    this works with serial console programs. Anything else that 
+    doesn't type a character is ignored.
+======================================================================*/
+static size_t encode_text (int device, const struct input_event *events, 
+    int n, char *out)
+  {
+  char *p = out;
+  // The benchmark encodes events without opening the sink
+  if (!text_layout) text_layout = layout_find ("us");
+  for (int i = 0; i < n; i++)
+    {
+    const struct input_event *ev = &events[i];
+    if (ev->type != EV_KEY) continue;
+    int mod = 0;
+    switch (ev->code)
+      {
+      case KEY_LEFTSHIFT: case KEY_RIGHTSHIFT: mod = LAYOUT_SHIFT; break;
+      case KEY_RIGHTALT: mod = LAYOUT_ALTGR; break;
+      case KEY_LEFTCTRL: case KEY_RIGHTCTRL: text_ctrl = ev->value != 0;
+        continue;
+      }
+    if (mod)
+      {
+      if (ev->value) text_mods |= mod; else text_mods &= ~mod;
+      continue;
+      }
+    if (ev->value == 0) continue; // Releases don't type anything
+    uint32_t ch;
+    switch (ev->code)
+      {
+      case KEY_ENTER: ch = '\r'; break;
+      case KEY_BACKSPACE: ch = 0x7F; break;
+      case KEY_ESC: ch = 0x1B; break;
+      default: ch = layout_char (text_layout, ev->code, text_mods);
+      }
+    if (ch == 0) continue;
+    if (text_ctrl && ch >= '@' && ch < 0x7F) ch &= 0x1F;
+    p += utf8_put_char (ch, p);
+    }
+  return p - out;
+  }
+
+/*======================================================================
+  open_socket
+  Connect to a Unix socket for the socket sink. Writes to a socket
+    whose reader has gone away should fail, not kill the program.
+======================================================================*/
+static void open_socket (const char *arg, const MapImage *image, int *fds)
+  {
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (!arg || strlen (arg) >= sizeof (addr.sun_path))
+    {
+    fprintf (stderr, "The socket sink needs the path of a socket\n");
+    exit (-1);
+    }
+  strcpy (addr.sun_path, arg);
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect (fd, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+    {
+    fprintf (stderr, "Can't connect to %s: %s\n", arg, strerror (errno));
+    exit (-1);
+    }
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  signal (SIGPIPE, SIG_IGN);
+  share_fd (fd, image, fds);
+  }
+
+/*======================================================================
+  encode_socket
+======================================================================*/
+static size_t encode_socket (int device, 
+    const struct input_event *events, int n, char *out)
+  {
+  SinkEvent *se = (SinkEvent *)out;
+  for (int i = 0; i < n; i++, se++)
+    {
+    se->usec = (uint64_t)events[i].input_event_sec * 1000000 
+      + events[i].input_event_usec;
+    se->device = device;
+    se->type = events[i].type;
+    se->code = events[i].code;
+    se->value = events[i].value;
+    }
+  return n * sizeof (SinkEvent);
+  }
+
+/*======================================================================
+  open_json
+  The JSON sink writes to stdout, which is left as it is -- blocking,
+    if it was
+======================================================================*/
+static void open_json (const char *arg, const MapImage *image, int *fds)
+  {
+  share_fd (dup (STDOUT_FILENO), image, fds);
+  }
+
+/*======================================================================
+  encode_json
+======================================================================*/
+static size_t encode_json (int device, const struct input_event *events, 
+    int n, char *out)
+  {
+  char *p = out;
+  for (int i = 0; i < n; i++)
+    {
+    const struct input_event *ev = &events[i];
+    p += sprintf (p, "{\"time\":%lu.%06lu,\"device\":%d,\"type\":%u,"
+      "\"code\":%u,\"value\":%d}\n", (unsigned long)ev->input_event_sec,
+      (unsigned long)ev->input_event_usec, device, ev->type, ev->code, 
+      ev->value);
+    }
+  return p - out;
+  }
+
+static const Sink sinks[] =
+  {
+  {"uinput", open_uinput, NULL, close_uinput},
+  {"text", open_text, encode_text, close_shared},
+  {"socket", open_socket, encode_socket, close_shared},
+  {"json", open_json, encode_json, close_shared},
+  {NULL, NULL, NULL, NULL}
+  };
+
+/*======================================================================
+  sink_find
+  Find the sink named in a --sink option, and set 'arg' to whatever 
+    follows the ':', if anything. Returns NULL if there's no such sink.
+======================================================================*/
+const Sink *sink_find (const char *spec, const char **arg)
+  {
+  const char *colon = strchr (spec, ':');
+  size_t len = colon ? colon - spec : strlen (spec);
+  *arg = colon ? colon + 1 : NULL;
+  for (const Sink *s = sinks; s->name; s++)
+    {
+    if (strlen (s->name) == len && strncmp (s->name, spec, len) == 0) 
+      return s;
+    }
+  return NULL;
+  }
@@ -0,0 +1,52 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  sink.h
+
+  A sink is where the output events end up. Normally this is a set of 
+    uinput devices, but events can also be typed as text on a pty or
+    serial port, streamed to a Unix socket, or printed as JSON, which
+    is useful where there is no uinput, and for benchmarking.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#pragma once
+
+#include <stddef.h>
+#include "defs.h"
+#include "mapping.h"
+
+// SINK_MAX_EVENT_BYTES is the most that any sink's encoding of a single
+//   event can take
+#define SINK_MAX_EVENT_BYTES 96
+
+// The socket sink writes one of these for each event. Programs that 
+//   read from the socket can include this file to get the format.
+typedef struct __attribute__((packed)) _SinkEvent
+  {
+  uint64_t usec;          // Timestamp, on the monotonic clock
+  uint8_t device;         // Index of the device in the mapping image
+  uint8_t type;
+  uint16_t code;
+  int32_t value;
+  } SinkEvent;
+
+typedef struct _Sink
+  {
+  const char *name;
+  // Open the sink, given whatever followed the ':' in --sink, or NULL,
+  //   and set a file descriptor for each device in the image. Several
+  //   devices can share a descriptor. Any failure is fatal.
+  void (*open) (const char *arg, const MapImage *image, int *fds);
+  // Convert a batch of events for one device into the bytes to write to
+  //   its descriptor, and return how many there are. 'out' has room for
+  //   SINK_MAX_EVENT_BYTES per event. If this is NULL, the events are 
+  //   written as they are.
+  size_t (*encode) (int device, const struct input_event *events, int n, 
+    char *out);
+  void (*close) (const int *fds, int nfds);
+  } Sink;
+
+const Sink *sink_find (const char *spec, const char **arg);
@@ -0,0 +1,296 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  stats.c
+
+  The statistics socket -- see stats.h. The socket is served by a
+    thread of its own, so a slow reader never holds up the main loop
+    or the output thread. Each connection gets one snapshot, and is
+    then closed.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "stats.h"
+#include "output.h"
+
+static const MapImage *image = NULL;
+static const PinStats *pin_stats = NULL;
+static const LoopStats *loop_stats = NULL;
+static const char *socket_path = NULL;
+static int listen_fd = -1;
+static int stop_fd = -1;
+static pthread_t stats_thread;
+
+/*======================================================================
+  hist_snapshot
+  Copy a histogram consistently, while its owner might be updating it.
+    This can be called from any thread.
+======================================================================*/
+void hist_snapshot (const Histogram *h, Histogram *copy)
+  {
+  Histogram *src = (Histogram *)h;
+  for (;;)
+    {
+    unsigned seq = atomic_load_explicit (&src->seq, memory_order_acquire);
+    if (seq & 1)
+      {
+      sched_yield();
+      continue;
+      }
+    copy->count = src->count;
+    copy->total = src->total;
+    copy->max = src->max;
+    memcpy (copy->counts, src->counts, sizeof (copy->counts));
+    atomic_thread_fence (memory_order_acquire);
+    if (atomic_load_explicit (&src->seq, memory_order_relaxed) == seq) 
+      break;
+    }
+  atomic_store_explicit (&copy->seq, 0, memory_order_relaxed);
+  }
+
+/*======================================================================
+  bucket_low
+  Get the lowest value that goes in a bucket -- the reverse of 
+    hist_bucket()
+======================================================================*/
+static uint64_t bucket_low (int b)
+  {
+  if (b < 2 * HIST_SUB) return b;
+  int shift = b / HIST_SUB - 1;
+  return (uint64_t)(b - shift * HIST_SUB) << shift;
+  }
+
+/*======================================================================
+  hist_percentile
+  Get the value that 'per_mille' thousandths of the values in a copy of
+    a histogram are no more than. This is the top of the bucket it is
+    in, so it is never an underestimate, except that it is never more
+    than the largest value.
+======================================================================*/
+uint64_t hist_percentile (const Histogram *copy, int per_mille)
+  {
+  if (copy->count == 0) return 0;
+  uint64_t target = (copy->count * per_mille + 999) / 1000;
+  if (target == 0) target = 1;
+  uint64_t seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+    seen += copy->counts[b];
+    if (seen < target) continue;
+    uint64_t top = bucket_low (b + 1) - 1;
+    return top < copy->max ? top : copy->max;
+    }
+  return copy->max;
+  }
+
+/*======================================================================
+  write_hist
+======================================================================*/
+static void write_hist (FILE *f, const char *name, const Histogram *h)
+  {
+  Histogram copy;
+  hist_snapshot (h, &copy);
+  fprintf (f, "latency.%s.count %llu\n", name, 
+    (unsigned long long)copy.count);
+  fprintf (f, "latency.%s.mean_usec %.3f\n", name,
+    copy.count ? copy.total / 1e3 / copy.count : 0.0);
+  fprintf (f, "latency.%s.p50_usec %.3f\n", name, 
+    hist_percentile (&copy, 500) / 1e3);
+  fprintf (f, "latency.%s.p90_usec %.3f\n", name, 
+    hist_percentile (&copy, 900) / 1e3);
+  fprintf (f, "latency.%s.p99_usec %.3f\n", name, 
+    hist_percentile (&copy, 990) / 1e3);
+  fprintf (f, "latency.%s.p99_9_usec %.3f\n", name, 
+    hist_percentile (&copy, 999) / 1e3);
+  fprintf (f, "latency.%s.max_usec %.3f\n", name, copy.max / 1e3);
+  }
+
+/*======================================================================
+  stats_write
+  Write a snapshot of all the counters. This can be called from any
+    thread; each counter is read once, so the snapshot isn't quite
+    consistent from one counter to the next, if the program is busy.
+======================================================================*/
+void stats_write (FILE *f)
+  {
+  for (int i = 0; i < image->nentries; i++)
+    {
+    const PinStats *p = &pin_stats[i];
+    int pin = mapimage_entry (image, i)->pin;
+    fprintf (f, "pin.%d.edges %llu\n", pin,
+      (unsigned long long)counter_get (&p->edges));
+    fprintf (f, "pin.%d.bounces %llu\n", pin,
+      (unsigned long long)counter_get (&p->bounces));
+    fprintf (f, "pin.%d.presses %llu\n", pin,
+      (unsigned long long)counter_get (&p->presses));
+    fprintf (f, "pin.%d.releases %llu\n", pin,
+      (unsigned long long)counter_get (&p->releases));
+    fprintf (f, "pin.%d.rejected %llu\n", pin,
+      (unsigned long long)counter_get (&p->rejected));
+    fprintf (f, "pin.%d.read_errors %llu\n", pin,
+      (unsigned long long)counter_get (&p->read_errors));
+    }
+  fprintf (f, "loop.wakeups %llu\n",
+    (unsigned long long)counter_get (&loop_stats->wakeups));
+
+  const RingStats *ring = output_get_ring_stats();
+  fprintf (f, "ring.submitted %llu\n",
+    (unsigned long long)counter_get (&ring->submitted));
+  fprintf (f, "ring.full %llu\n",
+    (unsigned long long)counter_get (&ring->full));
+  fprintf (f, "ring.high_water %llu\n",
+    (unsigned long long)counter_get (&ring->high_water));
+  fprintf (f, "ring.depth.normal %u\n", output_ring_depth (0));
+  fprintf (f, "ring.depth.urgent %u\n", output_ring_depth (1));
+
+  const OutputStats *out = output_get_stats();
+  fprintf (f, "output.events %llu\n",
+    (unsigned long long)counter_get (&out->events));
+  fprintf (f, "output.writes %llu\n",
+    (unsigned long long)counter_get (&out->writes));
+  fprintf (f, "output.device_busy %llu\n",
+    (unsigned long long)counter_get (&out->device_busy));
+  fprintf (f, "output.errors %llu\n",
+    (unsigned long long)counter_get (&out->errors));
+  fprintf (f, "output.blocked %llu\n",
+    (unsigned long long)counter_get (&out->blocked));
+  fprintf (f, "output.dropped %llu\n",
+    (unsigned long long)counter_get (&out->dropped));
+  fprintf (f, "output.coalesced %llu\n",
+    (unsigned long long)counter_get (&out->coalesced));
+  fprintf (f, "output.cancelled %llu\n",
+    (unsigned long long)counter_get (&out->cancelled));
+  fprintf (f, "output.queued.normal %llu\n",
+    (unsigned long long)counter_get (&out->queued[0]));
+  fprintf (f, "output.queued.urgent %llu\n",
+    (unsigned long long)counter_get (&out->queued[1]));
+  fprintf (f, "output.wakeups %llu\n",
+    (unsigned long long)counter_get (&out->wakeups));
+  write_hist (f, "edge_to_accept", &ring->accept);
+  write_hist (f, "accept_to_emit", &out->accept_to_emit);
+  write_hist (f, "emit_duration", &out->emit_duration);
+  write_hist (f, "edge_to_output", &out->latency);
+  }
+
+/*======================================================================
+  serve
+  Send a snapshot to a client. It is built in memory first, so that it
+    can be sent without SIGPIPE, if the client has gone away.
+======================================================================*/
+static void serve (int fd)
+  {
+  char *text = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream (&text, &len);
+  if (!f) return;
+  stats_write (f);
+  fclose (f);
+  size_t sent = 0;
+  while (sent < len)
+    {
+    ssize_t n = send (fd, text + sent, len - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    sent += n;
+    }
+  free (text);
+  }
+
+/*======================================================================
+  stats_thread_main
+======================================================================*/
+static void *stats_thread_main (void *arg)
+  {
+  for (;;)
+    {
+    struct pollfd pfd[2] = {{listen_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    if (poll (pfd, 2, -1) < 0 && errno != EINTR) break;
+    if (pfd[1].revents & POLLIN) break;
+    if (!(pfd[0].revents & POLLIN)) continue;
+    int fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) continue;
+    // Don't let a client that doesn't read hold us up for ever
+    struct timeval tv = {1, 0};
+    setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+    serve (fd);
+    close (fd);
+    }
+  return NULL;
+  }
+
+/*======================================================================
+  stats_start
+  Start serving statistics on a Unix socket at 'path', replacing any
+    socket that is already there. 'pins' are the main loop's counters
+    for each pin, indexed like the image's entries, and 'loop' its
+    others. Any failure is fatal.
+======================================================================*/
+void stats_start (const char *path, const MapImage *_image,
+    const PinStats *pins, const LoopStats *loop)
+  {
+  image = _image;
+  pin_stats = pins;
+  loop_stats = loop;
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+    fprintf (stderr, "Socket path too long: %s\n", path);
+    exit (-1);
+    }
+  strcpy (addr.sun_path, path);
+  unlink (path);
+  listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0
+       || bind (listen_fd, (struct sockaddr *)&addr, sizeof (addr)) < 0
+       || listen (listen_fd, 4) < 0)
+    {
+    fprintf (stderr, "Can't listen on %s: %s\n", path, strerror (errno));
+    exit (-1);
+    }
+  socket_path = path;
+  stop_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  sigset_t all, old;
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  if (stop_fd < 0
+       || pthread_create (&stats_thread, NULL, stats_thread_main, NULL))
+    {
+    fprintf (stderr, "Can't start stats thread: %s\n", strerror (errno));
+    exit (-1);
+    }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  dbglog ("Serving statistics on %s\n", path);
+  }
+
+/*======================================================================
+  stats_stop
+  Stop serving statistics, and remove the socket
+======================================================================*/
+void stats_stop (void)
+  {
+  if (listen_fd < 0) return;
+  uint64_t one = 1;
+  write (stop_fd, &one, sizeof (one));
+  pthread_join (stats_thread, NULL);
+  close (stop_fd);
+  close (listen_fd);
+  unlink (socket_path);
+  listen_fd = -1;
+  }
@@ -0,0 +1,136 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  stats.h
+
+  Live statistics. Each thread keeps its own counters, which only it
+    ever writes, so counting costs no more than an ordinary increment,
+    and nothing is shared until someone asks. With --stats=PATH, a
+    thread listens on a Unix socket at PATH, and anything that connects
+    to it gets a snapshot of all the counters, as text, one
+    'name value' per line; for example:
+
+    $ socat - UNIX-CONNECT:/run/pi-button-to-kbd.sock
+
+  Latencies go in HDR-style histograms: each power of two is split into
+    HIST_SUB linear buckets, so every value is counted to within about
+    3%, from nanoseconds to minutes, in a fixed 9 kB. The thread that
+    owns a histogram updates it with plain increments, inside a 
+    sequence lock; a reader copies the whole histogram, and tries again
+    if the sequence number shows that it changed meanwhile. So the 
+    owner never waits, and a reader always gets a consistent copy.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#pragma once
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include "defs.h"
+#include "mapping.h"
+
+// A Counter is written by only one thread, so it is updated with a
+//   plain load and store, not a locked instruction, but it is atomic
+//   so that other threads can read it at any time without tearing,
+//   even where 64-bit stores are two instructions
+typedef _Atomic uint64_t Counter;
+
+// Each power of two is split into HIST_SUB buckets, and values up to 
+//   2^HIST_MAX_BITS nanoseconds (about 18 minutes) are counted; longer
+//   ones are counted as that
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct _Histogram
+  {
+  _Atomic unsigned seq;   // Odd while the owner is updating it
+  uint64_t count;
+  uint64_t total;         // Nanoseconds
+  uint64_t max;
+  uint64_t counts[HIST_BUCKETS];
+  } Histogram;
+
+// The main loop's counters for each pin
+typedef struct _PinStats
+  {
+  Counter edges;          // Times the main loop woke up for the pin
+  Counter bounces;        // Edges ignored during the bounce lock-out
+  Counter presses;        // Edges accepted as presses
+  Counter releases;       // Edges accepted as releases
+  Counter rejected;       // Edges whose level had gone back when read
+  Counter read_errors;    // Times the pin couldn't be read
+  } PinStats;
+
+// The main loop's other counters
+typedef struct _LoopStats
+  {
+  Counter wakeups;        // Times the main loop woke up, for any reason
+  } LoopStats;
+
+/*======================================================================
+  counter_add
+  Only called by the thread that owns the counter
+======================================================================*/
+static inline void counter_add (Counter *c, uint64_t n)
+  {
+  atomic_store_explicit (c,
+    atomic_load_explicit (c, memory_order_relaxed) + n,
+    memory_order_relaxed);
+  }
+
+/*======================================================================
+  counter_set
+  Only called by the thread that owns the counter
+======================================================================*/
+static inline void counter_set (Counter *c, uint64_t v)
+  {
+  atomic_store_explicit (c, v, memory_order_relaxed);
+  }
+
+/*======================================================================
+  counter_get
+======================================================================*/
+static inline uint64_t counter_get (const Counter *c)
+  {
+  return atomic_load_explicit ((Counter *)c, memory_order_relaxed);
+  }
+
+/*======================================================================
+  hist_bucket
+  Get the bucket for a value. Values below 2 * HIST_SUB have a bucket
+    each; above that, the top HIST_SUB_BITS + 1 bits pick the bucket.
+======================================================================*/
+static inline int hist_bucket (uint64_t v)
+  {
+  if (v >= (1ULL << HIST_MAX_BITS)) v = (1ULL << HIST_MAX_BITS) - 1;
+  if (v < 2 * HIST_SUB) return v;
+  int shift = 63 - __builtin_clzll (v) - HIST_SUB_BITS;
+  return shift * HIST_SUB + (v >> shift);
+  }
+
+/*======================================================================
+  hist_record
+  Count a value. Only called by the thread that owns the histogram.
+======================================================================*/
+static inline void hist_record (Histogram *h, uint64_t v)
+  {
+  unsigned seq = atomic_load_explicit (&h->seq, memory_order_relaxed);
+  atomic_store_explicit (&h->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+  h->counts[hist_bucket (v)]++;
+  h->count++;
+  h->total += v;
+  if (v > h->max) h->max = v;
+  atomic_store_explicit (&h->seq, seq + 2, memory_order_release);
+  }
+
+void hist_snapshot (const Histogram *h, Histogram *copy);
+uint64_t hist_percentile (const Histogram *copy, int per_mille);
+void stats_start (const char *path, const MapImage *image,
+       const PinStats *pins, const LoopStats *loop);
+void stats_stop (void);
+void stats_write (FILE *f);
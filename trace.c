@@ -0,0 +1,210 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  trace.c
+
+  Dumping and decoding the trace rings -- see trace.h. The dump is done
+    in the signal handler itself, using only open(), write() and
+    close(), so it works even if the main loop is stuck. The threads
+    carry on writing while it is done, so a record or two at the
+    oldest end of a ring may be overwritten while it is being saved;
+    the decoder leaves out the oldest record of a full ring for that
+    reason, and sorts the rest by time.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/input.h>
+#include "trace.h"
+#include "mapping.h"
+
+TraceRing trace_rings[TRACE_RINGS];
+
+static char trace_file[PATH_MAX] = "";
+static uint64_t trace_start = 0;
+
+static const char *ring_names[TRACE_RINGS] = {"main", "output"};
+
+static const char *kind_names[] =
+  {
+  NULL, "edge", "bounce", "press", "release", "reject", "ring-full",
+  "device-busy", "drop", "coalesce", "cancel"
+  };
+
+static const char *event_type_names[] = {"SYN", "KEY", "REL", "ABS"};
+
+// A record from a trace file, with the ring it came from
+typedef struct _Decoded
+  {
+  TraceRecord r;
+  int ring;
+  uint32_t seq;
+  } Decoded;
+
+/*======================================================================
+  trace_set_file
+  Set the file that trace_dump_signal() writes to, and the time the
+    program started
+======================================================================*/
+void trace_set_file (const char *filename, uint64_t start_nsec)
+  {
+  snprintf (trace_file, sizeof (trace_file), "%s", filename);
+  trace_start = start_nsec;
+  }
+
+/*======================================================================
+  trace_dump_signal
+  Signal handler that writes the trace rings to the trace file
+======================================================================*/
+void trace_dump_signal (int dummy)
+  {
+  int saved_errno = errno;
+  int fd = open (trace_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+    0644);
+  if (fd >= 0)
+    {
+    TraceHeader h;
+    memset (&h, 0, sizeof (h));
+    memcpy (h.magic, TRACE_MAGIC, 4);
+    h.version = TRACE_VERSION;
+    h.start_nsec = trace_start;
+    h.rings = TRACE_RINGS;
+    h.records = TRACE_RECORDS;
+    write (fd, &h, sizeof (h));
+    for (int i = 0; i < TRACE_RINGS; i++)
+      {
+      uint32_t next = atomic_load (&trace_rings[i].next);
+      write (fd, &next, sizeof (next));
+      write (fd, trace_rings[i].records, sizeof (trace_rings[i].records));
+      }
+    close (fd);
+    }
+  errno = saved_errno;
+  }
+
+/*======================================================================
+  compare_decoded
+  Sort by time, and then by the order each ring wrote them in
+======================================================================*/
+static int compare_decoded (const void *a, const void *b)
+  {
+  const Decoded *x = a;
+  const Decoded *y = b;
+  if (x->r.nsec != y->r.nsec) return x->r.nsec < y->r.nsec ? -1 : 1;
+  if (x->ring != y->ring) return x->ring - y->ring;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+  }
+
+/*======================================================================
+  print_record
+======================================================================*/
+static void print_record (FILE *out, const Decoded *d, uint64_t start)
+  {
+  const TraceRecord *r = &d->r;
+  fprintf (out, "%14.6f %-6s ", ((int64_t)(r->nsec - start)) / 1e9,
+    ring_names[d->ring]);
+  if (r->kind >= TRACE_EMIT)
+    {
+    int type = r->kind - TRACE_EMIT;
+    const char *name = type == EV_KEY ? key_name (r->pin) : NULL;
+    fprintf (out, "emit device %d ", r->device);
+    if (type < sizeof (event_type_names) / sizeof (char *))
+      fprintf (out, "%s ", event_type_names[type]);
+    else
+      fprintf (out, "type %d ", type);
+    if (name)
+      fprintf (out, "%s %d\n", name, r->value);
+    else
+      fprintf (out, "%d %d\n", r->pin, r->value);
+    return;
+    }
+  const char *kind = r->kind < sizeof (kind_names) / sizeof (char *)
+    ? kind_names[r->kind] : NULL;
+  switch (r->kind)
+    {
+    case TRACE_EDGE:
+    case TRACE_PRESS:
+    case TRACE_RELEASE:
+    case TRACE_REJECT:
+      fprintf (out, "%s pin %d level %d\n", kind, r->pin, r->value);
+      break;
+    case TRACE_DEVICE_BUSY:
+      fprintf (out, "%s device %d\n", kind, r->device);
+      break;
+    case TRACE_CANCEL:
+      fprintf (out, "%s %d macro(s)\n", kind, r->value);
+      break;
+    default:
+      if (kind)
+        fprintf (out, "%s pin %d\n", kind, r->pin);
+      else
+        fprintf (out, "unknown record %d\n", r->kind);
+    }
+  }
+
+/*======================================================================
+  trace_decode
+  Print a trace file as text, in time order. Times are in seconds from
+    when the program started. Any error is fatal.
+======================================================================*/
+void trace_decode (const char *filename, FILE *out)
+  {
+  FILE *f = fopen (filename, "rb");
+  if (!f)
+    {
+    fprintf (stderr, "Can't open %s: %s\n", filename, strerror (errno));
+    exit (-1);
+    }
+  TraceHeader h;
+  if (fread (&h, sizeof (h), 1, f) != 1
+       || memcmp (h.magic, TRACE_MAGIC, 4) != 0
+       || h.version != TRACE_VERSION || h.rings > TRACE_RINGS
+       || h.records == 0 || (h.records & (h.records - 1)) != 0)
+    {
+    fprintf (stderr, "%s is not a trace file\n", filename);
+    exit (-1);
+    }
+  Decoded *all = malloc (h.rings * h.records * sizeof (Decoded));
+  TraceRecord *records = malloc (h.records * sizeof (TraceRecord));
+  if (!all || !records)
+    {
+    fprintf (stderr, "Out of memory\n");
+    exit (-1);
+    }
+  int n = 0;
+  for (int ring = 0; ring < h.rings; ring++)
+    {
+    uint32_t next;
+    if (fread (&next, sizeof (next), 1, f) != 1
+         || fread (records, sizeof (TraceRecord), h.records, f)
+              != h.records)
+      {
+      fprintf (stderr, "%s is truncated\n", filename);
+      exit (-1);
+      }
+    // The oldest record of a full ring may have been overwritten while
+    //   it was being dumped
+    uint32_t first = next > h.records ? next - h.records + 1 : 0;
+    for (uint32_t seq = first; seq != next; seq++)
+      {
+      all[n].r = records[seq & (h.records - 1)];
+      all[n].ring = ring;
+      all[n].seq = seq;
+      n++;
+      }
+    }
+  fclose (f);
+  qsort (all, n, sizeof (Decoded), compare_decoded);
+  for (int i = 0; i < n; i++)
+    print_record (out, &all[i], h.start_nsec);
+  free (records);
+  free (all);
+  }
@@ -0,0 +1,104 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  trace.h
+
+  The trace rings: an always-on record of what the program has done
+    recently, kept in memory in binary, for working out afterwards why
+    a button "didn't work". The main loop records each edge, and what
+    it decided about it; the output thread records each event it
+    outputs, and anything that held it up. Each thread has a ring of
+    its own, so a record is just a few stores, with no locking.
+
+  SIGUSR1 writes both rings to the trace file (--trace-file), and
+    --decode-trace prints a trace file as text, in time order.
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#pragma once
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include "defs.h"
+
+// TRACE_RECORDS is the number of records each ring keeps. It must be a
+//   power of two.
+#define TRACE_RECORDS 4096
+
+#define TRACE_MAGIC "PBKT"
+#define TRACE_VERSION 1
+
+// The kinds of record
+typedef enum
+  {
+  TRACE_EDGE = 1,         // Main loop woke for 'pin', which read 'value'
+  TRACE_BOUNCE,           // Edge on 'pin' ignored in the lock-out
+  TRACE_PRESS,            // Edge on 'pin' accepted as a press
+  TRACE_RELEASE,          // Edge on 'pin' accepted as a release
+  TRACE_REJECT,           // Edge on 'pin' had gone back to 'value'
+  TRACE_RING_FULL,        // Press on 'pin' dropped: the ring was full
+  TRACE_DEVICE_BUSY,      // Device 'device' couldn't take more events
+  TRACE_DROP,             // Queued macro for 'pin' discarded
+  TRACE_COALESCE,         // Press on 'pin' merged with a queued one
+  TRACE_CANCEL,           // 'value' queued macros cancelled
+  // An event output to 'device': the kind is TRACE_EMIT plus the event
+  //   type, and 'pin' is the event code
+  TRACE_EMIT = 0x20
+  } TraceKind;
+
+typedef struct _TraceRecord
+  {
+  uint64_t nsec;          // On the program's clock
+  uint8_t kind;
+  uint8_t device;
+  uint16_t pin;           // Or the event code
+  int32_t value;
+  } TraceRecord;
+
+typedef struct _TraceRing
+  {
+  _Atomic uint32_t next;  // Free-running count of records written
+  TraceRecord records[TRACE_RECORDS];
+  } TraceRing;
+
+// The rings for the main loop and the output thread
+#define TRACE_MAIN 0
+#define TRACE_OUTPUT 1
+#define TRACE_RINGS 2
+
+extern TraceRing trace_rings[TRACE_RINGS];
+
+// The trace file is a TraceHeader, followed by each ring's 'next', and
+//   then its records
+typedef struct _TraceHeader
+  {
+  char magic[4];
+  uint32_t version;
+  uint64_t start_nsec;    // When the program started, on the same clock
+  uint32_t rings;
+  uint32_t records;       // In each ring
+  } TraceHeader;
+
+/*======================================================================
+  trace
+  Add a record to a ring. Only called by the thread that owns it.
+======================================================================*/
+static inline void trace (int ring, uint64_t nsec, int kind, int device,
+    int pin, int value)
+  {
+  TraceRing *r = &trace_rings[ring];
+  uint32_t n = atomic_load_explicit (&r->next, memory_order_relaxed);
+  TraceRecord *t = &r->records[n & (TRACE_RECORDS - 1)];
+  t->nsec = nsec;
+  t->kind = kind;
+  t->device = device;
+  t->pin = pin;
+  t->value = value;
+  atomic_store_explicit (&r->next, n + 1, memory_order_release);
+  }
+
+void trace_set_file (const char *filename, uint64_t start_nsec);
+void trace_dump_signal (int dummy);
+void trace_decode (const char *filename, FILE *out);
@@ -0,0 +1,57 @@
+/*======================================================================
+
+  pi_button_to_kbd
+
+  usdt.h
+
+  Static tracepoints (USDT probes), for perf, bpftrace and the like to
+    attach to on a running program. Each one compiles to a single no-op
+    instruction, plus a note in the ELF file saying where it is and
+    where its arguments are, so they cost nothing until something
+    attaches to them. They need <sys/sdt.h> (from systemtap-sdt-dev or
+    systemtap-sdt-devel) at build time; without it, or with -DNO_USDT,
+    they compile to nothing at all.
+
+  The probes, all in provider pi_button_to_kbd, with their arguments:
+
+  edge (pin, level, nsec)       the main loop woke for an edge
+  bounce (pin, nsec)            an edge was ignored in the lock-out
+  accept (pin, level, nsec)     an edge settled to a press or release
+  reject (pin, level, nsec)     an edge settled back to where it was
+  press (pin, state, edge_nsec) a press was passed to the output thread
+  release (pin, edge_nsec)      a release was passed to the output thread
+  write_begin (device, nevents) the output thread is writing a batch
+  write_end (device, nevents, nsec, ok)
+                                ...and has finished, after 'nsec'
+
+  All times are nanoseconds on the program's clock. For example:
+
+  # bpftrace -e 'usdt:./pi-button-to-kbd:pi_button_to_kbd:write_end
+      { @[arg0] = hist(arg2); }'
+
+  Kevin Boone, CPL v3.0
+
+======================================================================*/
+#pragma once
+
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT 1
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define USDT2(name, a, b) DTRACE_PROBE2(pi_button_to_kbd, name, a, b)
+#define USDT3(name, a, b, c) DTRACE_PROBE3(pi_button_to_kbd, name, a, b, c)
+#define USDT4(name, a, b, c, d) \
+  DTRACE_PROBE4(pi_button_to_kbd, name, a, b, c, d)
+#else
+// The arguments are not evaluated, but still count as used
+#define USDT2(name, a, b) do { (void)sizeof (a); (void)sizeof (b); } \
+  while (0)
+#define USDT3(name, a, b, c) do { USDT2 (name, a, b); (void)sizeof (c); } \
+  while (0)
+#define USDT4(name, a, b, c, d) \
+  do { USDT3 (name, a, b, c); (void)sizeof (d); } while (0)
+#endif